@@ -10,11 +10,145 @@
 
 #define CTRL_R 0x12
 
-#define CLEAR_EOL "\x1b[0K"
-#define MOVE_BOL "\x1b[1G"
+#define CLEAR_EOL "\x1b[K"
+#define MOVE_BOL "\r"
+#define PASTE_ENABLE "\x1b[?2004h"
+
+#if EMBEDDED_CLI_RUNTIME_BUFFERS
+#define CLI_LINE_SIZE(cli) ((cli)->line_size)
+#define CLI_HISTORY_SIZE(cli) ((cli)->history_size)
+#define CLI_MAX_ARGC(cli) ((cli)->max_argc)
+#else
+#define CLI_LINE_SIZE(cli) sizeof((cli)->buffer)
+#define CLI_HISTORY_SIZE(cli) sizeof((cli)->history)
+#define CLI_MAX_ARGC(cli) EMBEDDED_CLI_MAX_ARGC
+#endif
+
+#if EMBEDDED_CLI_STATS
+#define CLI_STAT(cli, name, n) ((cli)->stats.name += (uint32_t)(n))
+#else
+#define CLI_STAT(cli, name, n) ((void)0)
+#endif
+
+/**
+ * Progress through an escape sequence (cli->escape)
+ */
+enum {
+    ESC_NONE,     // Not in an escape sequence
+    ESC_START,    // Had ESC
+    ESC_CSI,      // Had ESC [, reading the first parameter
+    ESC_CSI_MOD,  // Reading the second parameter, the modifier keys
+    ESC_CSI_SKIP, // Not a key we know, skip to the end
+    ESC_SS3,      // Had ESC O
+    ESC_FINAL,    // End of the sequence
+    ESC_ABORT,    // Not part of the sequence, so it has been abandoned
+};
+
+static void embedded_cli_sync(struct embedded_cli *cli);
+
+#if EMBEDDED_CLI_TX_BUF_LEN
+static void embedded_cli_redraw(struct embedded_cli *cli);
+
+/**
+ * Make everything queued so far visible to embedded_cli_tx_peek
+ */
+static void cli_tx_publish(struct embedded_cli *cli)
+{
+    // Make sure the characters are visible before the new head
+    EMBEDDED_CLI_BARRIER();
+    cli->tx_head = cli->tx_fill;
+}
+
+static void cli_txchar(struct embedded_cli *cli, char ch)
+{
+    size_t next = ((size_t)cli->tx_fill + 1) % EMBEDDED_CLI_TX_BUF_LEN;
+    if (cli->tx_dropped)
+        return;
+    while (next == cli->tx_tail) {
+        if (cli->tx_policy != EMBEDDED_CLI_TX_BLOCK) {
+            // Throw away the whole of this update, rather than leave
+            // half an escape sequence on the wire. The line gets redrawn
+            // once there's room
+            cli->tx_fill = cli->tx_head;
+            cli->tx_dropped = true;
+            return;
+        }
+        cli_tx_publish(cli);
+        if (cli->tx_wait)
+            cli->tx_wait(cli->cb_data);
+    }
+    cli->tx_buf[cli->tx_fill] = ch;
+    cli->tx_fill = (embedded_cli_tx_index_t)next;
+}
+
+static void cli_tx_flush(struct embedded_cli *cli)
+{
+    if (cli->tx_dropped) {
+        // If this doesn't fit either, it will have been discarded, so
+        // we'll try again next time
+        cli->tx_dropped = false;
+        embedded_cli_redraw(cli);
+    }
+    cli_tx_publish(cli);
+}
+#endif
+
+#if EMBEDDED_CLI_OUTPUT_BUF_LEN || EMBEDDED_CLI_TX_BUF_LEN
+static void cli_flush(struct embedded_cli *cli)
+{
+#if EMBEDDED_CLI_TX_BUF_LEN
+    if (cli->tx_policy != EMBEDDED_CLI_TX_OFF) {
+        cli_tx_flush(cli);
+        return;
+    }
+#endif
+#if EMBEDDED_CLI_OUTPUT_BUF_LEN
+    if (cli->out_len > 0) {
+        cli->put_buf(cli->cb_data, cli->out_buf, cli->out_len);
+        cli->out_len = 0;
+    }
+#endif
+}
+#else
+#define cli_flush(cli) ((void)(cli))
+#endif
+
+#if EMBEDDED_CLI_OUTPUT_BUF_LEN
+static void cli_bufchar(struct embedded_cli *cli, char ch)
+{
+    if (cli->out_len >= sizeof(cli->out_buf))
+        cli_flush(cli);
+    cli->out_buf[cli->out_len++] = ch;
+}
+#endif
 
 static void cli_putchar(struct embedded_cli *cli, char ch, bool is_last)
 {
+    // Anything held back has to go out before we write over it
+    if (cli->dirty)
+        embedded_cli_sync(cli);
+    CLI_STAT(cli, output_bytes,
+             EMBEDDED_CLI_SERIAL_XLATE && ch == '\n' ? 2 : 1);
+#if EMBEDDED_CLI_TX_BUF_LEN
+    if (cli->tx_policy != EMBEDDED_CLI_TX_OFF) {
+#if EMBEDDED_CLI_SERIAL_XLATE
+        if (ch == '\n')
+            cli_txchar(cli, '\r');
+#endif
+        cli_txchar(cli, ch);
+        return;
+    }
+#endif
+#if EMBEDDED_CLI_OUTPUT_BUF_LEN
+    if (cli->put_buf) {
+#if EMBEDDED_CLI_SERIAL_XLATE
+        if (ch == '\n')
+            cli_bufchar(cli, '\r');
+#endif
+        cli_bufchar(cli, ch);
+        return;
+    }
+#endif
     if (cli->put_char) {
 #if EMBEDDED_CLI_SERIAL_XLATE
         if (ch == '\n')
@@ -30,312 +164,1484 @@ static void cli_puts(struct embedded_cli *cli, const char *s)
         cli_putchar(cli, *s, s[1] == '\0');
 }
 
+static void cli_write(struct embedded_cli *cli, const char *s, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        cli_putchar(cli, s[i], i == n - 1);
+}
+
 static void embedded_cli_reset_line(struct embedded_cli *cli)
 {
     cli->len = 0;
     cli->cursor = 0;
+    cli->escape = ESC_NONE;
     cli->counter = 0;
-    cli->have_csi = cli->have_escape = false;
+    cli->modifier = 0;
+    cli->parsed = false;
+    cli->screen_cursor = cli->screen_len = 0;
+    cli->dirty = false;
+#if EMBEDDED_CLI_TX_BUF_LEN
+    cli->tx_prompted = false;
+#endif
 #if EMBEDDED_CLI_HISTORY_LEN
-    cli->history_pos = -1;
+    cli->history_pos = 0;
     cli->searching = false;
+    cli->search_pos = 0;
 #endif
 }
 
+/**
+ * Set up everything apart from the line, history & argv storage
+ */
+static void embedded_cli_start(struct embedded_cli *cli, const char *prompt,
+                               void (*put_char)(void *data, char ch,
+                                                bool is_last),
+                               void *cb_data)
+{
+    memset(cli, 0, sizeof(*cli));
+    embedded_cli_set_put_char(cli, put_char, cb_data);
+    embedded_cli_set_prompt(cli, prompt);
+    embedded_cli_reset_line(cli);
+}
+
+#if EMBEDDED_CLI_RUNTIME_BUFFERS
+bool embedded_cli_init_buffers(struct embedded_cli *cli, const char *prompt,
+                               void (*put_char)(void *data, char ch,
+                                                bool is_last),
+                               void *cb_data,
+                               const struct embedded_cli_buffers *buffers)
+{
+    // There must be room for at least one character and its nul, and for
+    // the NULL which ends argv
+    if (buffers->line_size < 2 || buffers->max_argc < 1)
+        return false;
+    embedded_cli_start(cli, prompt, put_char, cb_data);
+    // Sizes are limited by the types (and decode buffer) chosen at compile
+    // time
+    cli->buffer = buffers->line;
+    cli->line_size = buffers->line_size < EMBEDDED_CLI_MAX_LINE
+                         ? buffers->line_size
+                         : EMBEDDED_CLI_MAX_LINE;
+    cli->buffer[0] = '\0';
+#if EMBEDDED_CLI_HISTORY_LEN
+    cli->history = buffers->history;
+    cli->history_size = buffers->history_size < EMBEDDED_CLI_HISTORY_LEN
+                            ? buffers->history_size
+                            : EMBEDDED_CLI_HISTORY_LEN;
+#endif
+    cli->argv = buffers->argv;
+    cli->max_argc = buffers->max_argc < EMBEDDED_CLI_MAX_ARGC
+                        ? buffers->max_argc
+                        : EMBEDDED_CLI_MAX_ARGC;
+    return true;
+}
+#endif
+
+#if !EMBEDDED_CLI_RUNTIME_BUFFERS || EMBEDDED_CLI_BUILTIN_BUFFERS
 void embedded_cli_init(struct embedded_cli *cli, const char *prompt,
                        void (*put_char)(void *data, char ch, bool is_last),
                        void *cb_data)
 {
-    memset(cli, 0, sizeof(*cli));
+#if EMBEDDED_CLI_RUNTIME_BUFFERS
+    struct embedded_cli_buffers buffers = {
+        cli->builtin_line,
+        sizeof(cli->builtin_line),
+#if EMBEDDED_CLI_HISTORY_LEN
+        cli->builtin_history,
+        sizeof(cli->builtin_history),
+#else
+        NULL,
+        0,
+#endif
+        cli->builtin_argv,
+        EMBEDDED_CLI_MAX_ARGC,
+    };
+    embedded_cli_init_buffers(cli, prompt, put_char, cb_data, &buffers);
+#else
+    embedded_cli_start(cli, prompt, put_char, cb_data);
+#endif
+}
+#endif
+
+void embedded_cli_set_put_char(struct embedded_cli *cli,
+                               void (*put_char)(void *data, char ch,
+                                                bool is_last),
+                               void *cb_data)
+{
+    cli_flush(cli);
     cli->put_char = put_char;
     cli->cb_data = cb_data;
+}
+
+void embedded_cli_set_prompt(struct embedded_cli *cli, const char *prompt)
+{
     if (prompt) {
         strncpy(cli->prompt, prompt, sizeof(cli->prompt));
         cli->prompt[sizeof(cli->prompt) - 1] = '\0';
+    } else {
+        cli->prompt[0] = '\0';
     }
+}
 
-    embedded_cli_reset_line(cli);
+#if EMBEDDED_CLI_OUTPUT_BUF_LEN
+void embedded_cli_set_put_buf(struct embedded_cli *cli,
+                              void (*put_buf)(void *data, const char *buf,
+                                              size_t len))
+{
+    cli_flush(cli);
+    cli->put_buf = put_buf;
 }
+#endif
 
+static size_t digit_count(size_t n)
+{
+    size_t count = 1;
+    for (; n >= 10; n /= 10)
+        count++;
+    return count;
+}
+
+/**
+ * Outputs the control sequence ESC [ n code
+ */
 static void cli_ansi(struct embedded_cli *cli, size_t n, char code)
 {
-    char buffer[5] = {'\x1b', '[', (char)('0' + (n % 10)), code, '\0'};
+    char buffer[24];
+    size_t len = 2 + digit_count(n);
+    buffer[0] = '\x1b';
+    buffer[1] = '[';
+    for (size_t i = len; i > 2; i--, n /= 10)
+        buffer[i - 1] = (char)('0' + (n % 10));
+    buffer[len] = code;
+    buffer[len + 1] = '\0';
     cli_puts(cli, buffer);
 }
 
-static void term_cursor_back(struct embedded_cli *cli, size_t n)
+/**
+ * Ways of moving the cursor along the line
+ */
+enum term_move_type {
+    TERM_MOVE_CHARS,    // Backspaces, or reprint what we're moving over
+    TERM_MOVE_RELATIVE, // ESC [ n D or ESC [ n C
+    TERM_MOVE_ABSOLUTE, // ESC [ n G
+    TERM_MOVE_RETURN,   // Carriage return, then reprint prompt & line
+};
+
+/**
+ * Works out the cheapest way to move the cursor from buffer position
+ * `from` to `to`
+ * @return Number of bytes this will output
+ */
+static size_t term_move_cost(const struct embedded_cli *cli, size_t from,
+                             size_t to, enum term_move_type *type)
+{
+    size_t n = from > to ? from - to : to - from;
+    // 1 based terminal column, which is also the cost of returning to
+    // the start of the line & reprinting up to it
+    size_t column = strlen(cli->prompt) + to + 1;
+    size_t best = n;
+
+    *type = TERM_MOVE_CHARS;
+    if (3 + digit_count(n) < best) {
+        best = 3 + digit_count(n);
+        *type = TERM_MOVE_RELATIVE;
+    }
+    if (3 + digit_count(column) < best) {
+        best = 3 + digit_count(column);
+        *type = TERM_MOVE_ABSOLUTE;
+    }
+    if (column < best) {
+        best = column;
+        *type = TERM_MOVE_RETURN;
+    }
+    return best;
+}
+
+/**
+ * Moves the terminal cursor to position `to` in the buffer. Anything on
+ * screen before `to` must already match the buffer
+ */
+static void term_move(struct embedded_cli *cli, size_t to)
+{
+    size_t from = cli->screen_cursor;
+    enum term_move_type type;
+
+    term_move_cost(cli, from, to, &type);
+    switch (type) {
+    case TERM_MOVE_CHARS:
+        if (to > from)
+            cli_write(cli, &cli->buffer[from], to - from);
+        for (; from > to; from--)
+            cli_putchar(cli, '\b', from == to + 1);
+        break;
+    case TERM_MOVE_RELATIVE:
+        if (to > from)
+            cli_ansi(cli, to - from, 'C');
+        else
+            cli_ansi(cli, from - to, 'D');
+        break;
+    case TERM_MOVE_ABSOLUTE:
+        cli_ansi(cli, strlen(cli->prompt) + to + 1, 'G');
+        break;
+    case TERM_MOVE_RETURN:
+        cli_putchar(cli, '\r', true);
+        cli_puts(cli, cli->prompt);
+        cli_write(cli, cli->buffer, to);
+        break;
+    }
+    cli->screen_cursor = (embedded_cli_line_index_t)to;
+}
+
+/**
+ * Brings the terminal up to date with the buffer, which may have changed
+ * from position `from` onwards, then puts the cursor in the right place
+ */
+static void embedded_cli_draw(struct embedded_cli *cli, size_t from)
+{
+    size_t old_len = cli->screen_len;
+    enum term_move_type type;
+
+    if (from > old_len)
+        from = old_len;
+    if (from < cli->len) {
+        term_move(cli, from);
+        cli_write(cli, &cli->buffer[from], cli->len - from);
+        cli->screen_cursor = cli->len;
+    }
+    cli->screen_len = cli->len;
+
+    // Get rid of anything left over from a longer line, by either
+    // overwriting it with spaces or clearing to the end of the line
+    if (old_len > cli->len) {
+        size_t excess = old_len - cli->len;
+        term_move(cli, cli->len);
+        if (excess + term_move_cost(cli, old_len, cli->cursor, &type) <
+            3 + term_move_cost(cli, cli->len, cli->cursor, &type)) {
+            for (size_t i = 0; i < excess; i++)
+                cli_putchar(cli, ' ', i == excess - 1);
+            cli->screen_cursor = (embedded_cli_line_index_t)old_len;
+        } else {
+            cli_puts(cli, CLEAR_EOL);
+        }
+    }
+    term_move(cli, cli->cursor);
+}
+
+static void embedded_cli_sync(struct embedded_cli *cli)
 {
-    while (n > 0) {
-        size_t count = n > 9 ? 9 : n;
-        cli_ansi(cli, count, 'D');
-        n -= count;
+    if (cli->dirty) {
+        cli->dirty = false;
+        embedded_cli_draw(cli, cli->dirty_from);
     }
 }
 
-static void term_cursor_fwd(struct embedded_cli *cli, size_t n)
+/**
+ * Called after the buffer and/or cursor have changed, with `from` being the
+ * first position in the buffer which changed. If more input is on the way,
+ * the screen update is held back and merged with any others
+ */
+static void embedded_cli_refresh(struct embedded_cli *cli, size_t from)
 {
-    while (n > 0) {
-        size_t count = n > 9 ? 9 : n;
-        cli_ansi(cli, count, 'C');
-        n -= count;
+    bool defer = cli->defer_output;
+#if EMBEDDED_CLI_BRACKETED_PASTE
+    // Pasted text is only shown once the paste is complete
+    defer = defer || cli->pasting;
+#endif
+    if (defer) {
+        if (!cli->dirty || from < cli->dirty_from)
+            cli->dirty_from = (embedded_cli_line_index_t)from;
+        cli->dirty = true;
+        return;
     }
+    embedded_cli_draw(cli, from);
+}
+
+/**
+ * Redraws the prompt & line from scratch
+ */
+static void embedded_cli_redraw_line(struct embedded_cli *cli)
+{
+    cli_puts(cli, MOVE_BOL CLEAR_EOL);
+    cli_puts(cli, cli->prompt);
+    cli->screen_cursor = cli->screen_len = 0;
+    embedded_cli_refresh(cli, 0);
 }
 
 #if EMBEDDED_CLI_HISTORY_LEN
-static void term_backspace(struct embedded_cli *cli, size_t n)
+/**
+ * Replaces the whole line, redrawing only the part which has changed
+ */
+static void embedded_cli_set_line(struct embedded_cli *cli, const char *line)
 {
-    for (; n > 0; n--)
-        cli_putchar(cli, '\b', n == 1);
+    size_t same = 0;
+    while (same < cli->len && line[same] == cli->buffer[same])
+        same++;
+    strncpy(cli->buffer, line, CLI_LINE_SIZE(cli));
+    cli->buffer[CLI_LINE_SIZE(cli) - 1] = '\0';
+    cli->len = cli->cursor = (embedded_cli_line_index_t)strlen(cli->buffer);
+    embedded_cli_refresh(cli, same);
 }
 
-static const char *embedded_cli_get_history_search(struct embedded_cli *cli)
+/**
+ * Search back through the history for the current search term, starting at
+ * history entry `from`. On return search_pos is one more than the entry
+ * matched, or 0 if nothing matched
+ */
+static void embedded_cli_history_search(struct embedded_cli *cli, int from)
 {
-    for (int i = 0;; i++) {
+    for (int i = from; i >= 0; i++) {
         const char *h = embedded_cli_get_history(cli, i);
         if (!h)
-            return NULL;
-        if (strstr(h, cli->buffer))
-            return h;
+            break;
+        CLI_STAT(cli, search_compares, 1);
+        if (strstr(h, cli->buffer)) {
+            cli->search_pos = (embedded_cli_history_pos_t)(i + 1);
+            return;
+        }
     }
-    return NULL;
+    cli->search_pos = 0;
+}
+
+static void embedded_cli_show_search(struct embedded_cli *cli)
+{
+    const char *h = embedded_cli_get_history(cli, cli->search_pos - 1);
+    cli_puts(cli, MOVE_BOL CLEAR_EOL "search:");
+    if (h)
+        cli_puts(cli, h);
 }
 #endif
 
-static void embedded_cli_insert_default_char(struct embedded_cli *cli,
-                                             char ch)
+/**
+ * Inserts a run of plain characters at the cursor, and echoes them (and the
+ * remainder of the line) in one go
+ */
+static void embedded_cli_insert_run(struct embedded_cli *cli, const char *s,
+                                    size_t n)
 {
+    size_t start = cli->cursor;
     // If the buffer is full, there's nothing we can do
-    if (cli->len >= (int)sizeof(cli->buffer) - 1)
+    if (cli->len >= CLI_LINE_SIZE(cli) - 1)
         return;
-    // Insert a gap in the buffer for the new character
-    memmove(&cli->buffer[cli->cursor + 1], &cli->buffer[cli->cursor],
+    // Drop anything that won't fit
+    if (n > CLI_LINE_SIZE(cli) - 1 - cli->len)
+        n = CLI_LINE_SIZE(cli) - 1 - cli->len;
+    // Insert a gap in the buffer for the new characters
+    CLI_STAT(cli, memmove_bytes, cli->len - cli->cursor);
+    memmove(&cli->buffer[cli->cursor + n], &cli->buffer[cli->cursor],
             cli->len - cli->cursor);
-    cli->buffer[cli->cursor] = ch;
-    cli->len++;
+    memcpy(&cli->buffer[cli->cursor], s, n);
+    cli->len = (embedded_cli_line_index_t)(cli->len + n);
     cli->buffer[cli->len] = '\0';
-    cli->cursor++;
+    cli->cursor = (embedded_cli_line_index_t)(cli->cursor + n);
 
 #if EMBEDDED_CLI_HISTORY_LEN
     if (cli->searching) {
-        cli_puts(cli, MOVE_BOL CLEAR_EOL "search:");
-        const char *h = embedded_cli_get_history_search(cli);
-        if (h)
-            cli_puts(cli, h);
+        // If the search term has only been extended, then anything more
+        // recent than the current match still won't match, so we can carry
+        // on from there
+        if (start == 0 || cli->cursor == cli->len) {
+            if (cli->search_pos > 0)
+                embedded_cli_history_search(cli, cli->search_pos - 1);
+        } else {
+            embedded_cli_history_search(cli, 0);
+        }
+        embedded_cli_show_search(cli);
+    } else
+#endif
+        embedded_cli_refresh(cli, start);
+}
+
+static void embedded_cli_insert_default_char(struct embedded_cli *cli,
+                                             char ch)
+{
+    embedded_cli_insert_run(cli, &ch, 1);
+}
+
+#if EMBEDDED_CLI_HISTORY_LEN
+/**
+ * Find the slot in history_index of the entry history_pos back from the
+ * most recent
+ */
+static size_t embedded_cli_history_slot(const struct embedded_cli *cli,
+                                        int history_pos)
+{
+    return (cli->history_first + (size_t)(cli->history_count - 1) -
+            (size_t)history_pos) %
+           EMBEDDED_CLI_HISTORY_ENTRIES;
+}
+
+/**
+ * Find where a history entry is stored
+ */
+static const char *embedded_cli_history_entry(const struct embedded_cli *cli,
+                                              int history_pos)
+{
+    return &cli->history
+                [cli->history_index[embedded_cli_history_slot(cli,
+                                                              history_pos)]];
+}
+
+/**
+ * Discard the oldest history entry
+ */
+static void embedded_cli_history_evict(struct embedded_cli *cli)
+{
+#if EMBEDDED_CLI_HISTORY_COMPRESS
+    // The next entry may be stored relative to this one, in which case it
+    // has to be stored in full. It always directly follows this one, so
+    // the shared characters can be copied into the space being freed
+    if (cli->history_count > 1) {
+        size_t first = cli->history_index[cli->history_first];
+        size_t slot =
+            ((size_t)cli->history_first + 1) % EMBEDDED_CLI_HISTORY_ENTRIES;
+        size_t next = cli->history_index[slot];
+        size_t shared = (unsigned char)cli->history[next];
+        if (shared > 0) {
+            memmove(&cli->history[next + 1 - shared],
+                    &cli->history[first + 1], shared);
+            next -= shared;
+            cli->history[next] = '\0';
+            cli->history_index[slot] = (embedded_cli_history_offset_t)next;
+        }
+    }
+#endif
+    cli->history_first = (embedded_cli_history_slot_t)(
+        ((size_t)cli->history_first + 1) % EMBEDDED_CLI_HISTORY_ENTRIES);
+    cli->history_count--;
+    CLI_STAT(cli, history_evictions, 1);
+}
+#endif
+
+#if EMBEDDED_CLI_HISTORY_DEDUP
+/**
+ * 16-bit fingerprint of a line (FNV-1a, folded)
+ */
+static uint16_t embedded_cli_fingerprint(const char *line)
+{
+    uint32_t hash = 2166136261u;
+    while (*line) {
+        hash ^= (unsigned char)*line++;
+        hash *= 16777619u;
+    }
+    return (uint16_t)(hash ^ (hash >> 16));
+}
+
+/**
+ * Find the history entry matching the current line
+ * @return position of the entry, or -1 if there isn't one
+ */
+static int embedded_cli_history_find(const struct embedded_cli *cli,
+                                     uint16_t hash)
+{
+    for (int i = 0; i < cli->history_count; i++) {
+        size_t slot = embedded_cli_history_slot(cli, i);
+        if (cli->history_hash[slot] == hash &&
+            strcmp(&cli->history[cli->history_index[slot]], cli->buffer) ==
+                0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Move a history entry to a different position, shifting the entries in
+ * between along by one
+ */
+static void embedded_cli_history_move(struct embedded_cli *cli, int from,
+                                      int to)
+{
+    int step = from < to ? 1 : -1;
+    size_t slot = embedded_cli_history_slot(cli, from);
+    embedded_cli_history_offset_t index = cli->history_index[slot];
+    uint16_t hash = cli->history_hash[slot];
+
+    for (int i = from; i != to; i += step) {
+        size_t next = embedded_cli_history_slot(cli, i + step);
+        cli->history_index[slot] = cli->history_index[next];
+        cli->history_hash[slot] = cli->history_hash[next];
+        slot = next;
+    }
+    cli->history_index[slot] = index;
+    cli->history_hash[slot] = hash;
+}
+
+/**
+ * Discard all history entries stored at offsets between start & end. As
+ * entries are moved around, these aren't necessarily the oldest ones
+ */
+static void embedded_cli_history_discard(struct embedded_cli *cli,
+                                         size_t start, size_t end)
+{
+    for (int i = cli->history_count - 1; i >= 0; i--) {
+        size_t offset =
+            cli->history_index[embedded_cli_history_slot(cli, i)];
+        if (offset >= start && offset < end) {
+            embedded_cli_history_move(cli, i, cli->history_count - 1);
+            embedded_cli_history_evict(cli);
+        }
+    }
+}
+#endif
+
+#if EMBEDDED_CLI_HISTORY_COMPRESS
+/**
+ * Decode a history entry into history_line, starting from the closest
+ * entry which is stored in full
+ * @return number of entries which had to be decoded
+ */
+static int embedded_cli_history_decode(struct embedded_cli *cli,
+                                       int history_pos)
+{
+    int pos = history_pos;
+    // The oldest entry is always stored in full, so this will stop
+    while (*embedded_cli_history_entry(cli, pos) != '\0')
+        pos++;
+    for (int i = pos; i >= history_pos; i--) {
+        const char *entry = embedded_cli_history_entry(cli, i);
+        strcpy(&cli->history_line[(unsigned char)entry[0]], &entry[1]);
+    }
+    return pos - history_pos + 1;
+}
+#endif
+
+const char *embedded_cli_get_history(struct embedded_cli *cli,
+                                     int history_pos)
+{
+#if EMBEDDED_CLI_HISTORY_LEN
+    if (history_pos < 0 || history_pos >= cli->history_count)
+        return NULL;
+
+#if EMBEDDED_CLI_HISTORY_COMPRESS
+    embedded_cli_history_decode(cli, history_pos);
+    return cli->history_line;
+#else
+    return embedded_cli_history_entry(cli, history_pos);
+#endif
+#else
+    (void)cli;
+    (void)history_pos;
+    return NULL;
+#endif
+}
+
+#if EMBEDDED_CLI_HISTORY_STORE
+#define STORE_MAGIC "ECH"
+#define STORE_VERSION 1
+#define STORE_HEADER_LEN 8
+// Length read from erased flash, after the last record
+#define STORE_END 0xffff
+
+static uint16_t crc16(uint16_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len--) {
+        crc ^= (uint16_t)(*p++ << 8);
+        for (int i = 0; i < 8; i++)
+            crc = (uint16_t)(crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1);
+    }
+    return crc;
+}
+
+static void put_le16(uint8_t *buf, uint16_t val)
+{
+    buf[0] = (uint8_t)(val & 0xff);
+    buf[1] = (uint8_t)(val >> 8);
+}
 
+static uint16_t get_le16(const uint8_t *buf)
+{
+    return (uint16_t)(buf[0] | (buf[1] << 8));
+}
+
+/**
+ * Calculate the CRC of a history record, which covers the generation of
+ * the store, the length and the entry itself
+ */
+static uint16_t embedded_cli_record_crc(const struct embedded_cli *cli,
+                                        const uint8_t *len_buf,
+                                        const char *line, size_t len)
+{
+    uint8_t gen[2];
+    put_le16(gen, cli->store_generation);
+    return crc16(crc16(crc16(0xffff, gen, 2), len_buf, 2), line, len);
+}
+
+/**
+ * Read the header from the store, and check that it is valid
+ */
+static bool
+embedded_cli_read_header(const struct embedded_cli_history_store *store,
+                         uint8_t *header)
+{
+    return store->read(store->data, 0, header, STORE_HEADER_LEN) ==
+               STORE_HEADER_LEN &&
+           strncmp((const char *)header, STORE_MAGIC, 3) == 0 &&
+           header[3] == STORE_VERSION &&
+           get_le16(&header[6]) == crc16(0xffff, header, 6);
+}
+
+/**
+ * Write a history record at the end of the store. Nothing is written after
+ * it, so that each byte is only written once between erases; the end of the
+ * history is found by reading erased space or running off the end
+ */
+static bool embedded_cli_store_record(struct embedded_cli *cli,
+                                      const char *line)
+{
+    const struct embedded_cli_history_store *store = cli->store;
+    size_t len = strlen(line);
+    uint8_t head[2], tail[2];
+
+    put_le16(head, (uint16_t)len);
+    put_le16(tail, embedded_cli_record_crc(cli, head, line, len));
+    if (!store->write(store->data, cli->store_len, head, sizeof(head)) ||
+        !store->write(store->data, cli->store_len + 2, line, len) ||
+        !store->write(store->data, cli->store_len + 2 + len, tail,
+                      sizeof(tail)))
+        return false;
+    cli->store_len += len + 4;
+    return true;
+}
+
+bool embedded_cli_history_save(struct embedded_cli *cli,
+                               const struct embedded_cli_history_store *store)
+{
+    uint8_t header[STORE_HEADER_LEN];
+    size_t len = STORE_HEADER_LEN;
+    int count;
+
+    cli->store = NULL;
+    if (store->size < len)
+        return false;
+    // Records from the previous history may still be there, so make sure
+    // they can't be mistaken for the new ones
+    if (embedded_cli_read_header(store, header))
+        cli->store_generation = get_le16(&header[4]);
+    // Work out how many of the most recent entries will fit
+    for (count = 0; count < cli->history_count; count++) {
+        size_t record = strlen(embedded_cli_get_history(cli, count)) + 4;
+        if (len + record > store->size)
+            break;
+        len += record;
+    }
+
+    cli->store_generation++;
+    memcpy(header, STORE_MAGIC, 3);
+    header[3] = STORE_VERSION;
+    put_le16(&header[4], cli->store_generation);
+    put_le16(&header[6], crc16(0xffff, header, 6));
+    if (!store->write(store->data, 0, header, sizeof(header)))
+        return false;
+    cli->store = store;
+    cli->store_len = STORE_HEADER_LEN;
+    while (count-- > 0) {
+        if (!embedded_cli_store_record(cli,
+                                       embedded_cli_get_history(cli, count))) {
+            cli->store = NULL;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Add a new history entry to the store, if there is one
+ */
+static void embedded_cli_store_append(struct embedded_cli *cli,
+                                      const char *line)
+{
+    const struct embedded_cli_history_store *store = cli->store;
+    if (!store)
+        return;
+    // Once the store is full (or damaged), start it again with just the
+    // current history
+    if (cli->store_len + strlen(line) + 4 > store->size ||
+        !embedded_cli_store_record(cli, line))
+        embedded_cli_history_save(cli, store);
+}
+#endif
+
+#if EMBEDDED_CLI_HISTORY_LEN
+static void embedded_cli_extend_history(struct embedded_cli *cli)
+{
+    size_t len = strlen(cli->buffer);
+    size_t pos = cli->history_head;
+    size_t size = len + 1;
+    const char *last = NULL;
+#if EMBEDDED_CLI_HISTORY_COMPRESS
+    size_t shared = 0;
+    int chain = 0;
+
+    // Allow for the shared count, in case nothing can be shared
+    size++;
+    if (cli->history_count > 0) {
+        chain = embedded_cli_history_decode(cli, 0);
+        last = cli->history_line;
+    }
+#elif EMBEDDED_CLI_HISTORY_DEDUP
+    uint16_t hash = embedded_cli_fingerprint(cli->buffer);
+    int existing = embedded_cli_history_find(cli, hash);
+
+    if (existing == 0)
+        return;
+    // Bring the existing copy to the front, rather than storing it again
+    if (existing > 0) {
+        embedded_cli_history_move(cli, existing, 0);
+#if EMBEDDED_CLI_HISTORY_STORE
+        embedded_cli_store_append(cli, cli->buffer);
+#endif
+        return;
+    }
+#else
+    last = embedded_cli_get_history(cli, 0);
+#endif
+
+    // Check that the entry can be stored before evicting anything for it
+    if (len == 0 || size > CLI_HISTORY_SIZE(cli))
+        return;
+    // If the new entry is the same as the most recent history entry,
+    // then don't insert it
+    if (last && strcmp(cli->buffer, last) == 0)
+        return;
+
+    if (cli->history_count >= EMBEDDED_CLI_HISTORY_ENTRIES)
+        embedded_cli_history_evict(cli);
+#if EMBEDDED_CLI_HISTORY_COMPRESS
+    // Only store the characters which differ from the previous entry, as
+    // long as that directly precedes this one
+    if (cli->history_count > 0 && pos > 0 &&
+        chain < EMBEDDED_CLI_HISTORY_RESTART) {
+        while (shared < 0xff && last[shared] &&
+               last[shared] == cli->buffer[shared])
+            shared++;
+    }
+    size = len - shared + 2;
+#endif
+    // Entries are never split, so if there isn't room before the end of the
+    // buffer, drop anything stored after us and start again at the
+    // beginning
+    if (pos + size > CLI_HISTORY_SIZE(cli)) {
+#if EMBEDDED_CLI_HISTORY_DEDUP
+        embedded_cli_history_discard(cli, pos, CLI_HISTORY_SIZE(cli));
+#else
+        while (cli->history_count > 0 &&
+               cli->history_index[cli->history_first] >= pos)
+            embedded_cli_history_evict(cli);
+#endif
+        pos = 0;
+#if EMBEDDED_CLI_HISTORY_COMPRESS
+        shared = 0;
+        size = len + 2;
+#endif
+    }
+    // Make space by discarding the oldest entries we're about to overwrite
+#if EMBEDDED_CLI_HISTORY_DEDUP
+    embedded_cli_history_discard(cli, pos, pos + size);
+#else
+    while (cli->history_count > 0 &&
+           cli->history_index[cli->history_first] >= pos &&
+           cli->history_index[cli->history_first] < pos + size)
+        embedded_cli_history_evict(cli);
+#endif
+
+#if EMBEDDED_CLI_HISTORY_COMPRESS
+    cli->history[pos] = (char)shared;
+    memcpy(&cli->history[pos + 1], &cli->buffer[shared], len - shared + 1);
+#else
+    memcpy(&cli->history[pos], cli->buffer, len + 1);
+#endif
+    cli->history_count++;
+    cli->history_index[embedded_cli_history_slot(cli, 0)] =
+        (embedded_cli_history_offset_t)pos;
+#if EMBEDDED_CLI_HISTORY_DEDUP
+    cli->history_hash[embedded_cli_history_slot(cli, 0)] = hash;
+#endif
+    pos += size;
+    if (pos >= CLI_HISTORY_SIZE(cli))
+        pos = 0;
+    cli->history_head = (embedded_cli_history_offset_t)pos;
+#if EMBEDDED_CLI_HISTORY_STORE
+    embedded_cli_store_append(cli, cli->buffer);
+#endif
+}
+
+#if EMBEDDED_CLI_HISTORY_STORE
+bool embedded_cli_history_load(struct embedded_cli *cli,
+                               const struct embedded_cli_history_store *store)
+{
+    uint8_t header[STORE_HEADER_LEN];
+    bool clean = false;
+
+    // Loaded entries mustn't be appended again
+    cli->store = NULL;
+    if (!embedded_cli_read_header(store, header)) {
+        embedded_cli_history_save(cli, store);
+        return false;
+    }
+    cli->store_generation = get_le16(&header[4]);
+    cli->store_len = STORE_HEADER_LEN;
+
+    for (;;) {
+        size_t pos = cli->store_len;
+        uint8_t head[2], tail[2];
+        size_t len = store->read(store->data, pos, head, sizeof(head));
+
+        if (len != sizeof(head)) {
+            // Running off the end of a file is fine
+            clean = len == 0;
+            break;
+        }
+        len = get_le16(head);
+        if (len == STORE_END) {
+            clean = true;
+            break;
+        }
+        if (len == 0 || len >= CLI_LINE_SIZE(cli) ||
+            pos + len + 4 > store->size ||
+            store->read(store->data, pos + 2, cli->buffer, len) != len ||
+            store->read(store->data, pos + 2 + len, tail, sizeof(tail)) !=
+                sizeof(tail) ||
+            get_le16(tail) !=
+                embedded_cli_record_crc(cli, head, cli->buffer, len))
+            break;
+        cli->buffer[len] = '\0';
+        embedded_cli_extend_history(cli);
+        cli->store_len += len + 4;
+    }
+    cli->buffer[0] = '\0';
+
+    // Anything after a damaged record can't be written to safely
+    if (clean)
+        cli->store = store;
+    else
+        embedded_cli_history_save(cli, store);
+    return true;
+}
+#endif
+
+static void embedded_cli_stop_search(struct embedded_cli *cli, bool print)
+{
+    const char *h = embedded_cli_get_history(cli, cli->search_pos - 1);
+    if (h) {
+        strncpy(cli->buffer, h, CLI_LINE_SIZE(cli));
+        cli->buffer[CLI_LINE_SIZE(cli) - 1] = '\0';
     } else
+        cli->buffer[0] = '\0';
+    cli->len = cli->cursor = (embedded_cli_line_index_t)strlen(cli->buffer);
+    cli->searching = false;
+    if (print)
+        embedded_cli_redraw_line(cli);
+}
+#endif
+
+#if EMBEDDED_CLI_TX_BUF_LEN
+/**
+ * Output everything needed to bring the terminal up to date, no matter what
+ * it currently shows
+ */
+static void embedded_cli_redraw(struct embedded_cli *cli)
+{
+#if EMBEDDED_CLI_BRACKETED_PASTE
+    // This may have been lost along with the prompt
+    cli_puts(cli, PASTE_ENABLE);
+#endif
+#if EMBEDDED_CLI_HISTORY_LEN
+    if (cli->searching) {
+        embedded_cli_show_search(cli);
+        return;
+    }
+#endif
+    if (!cli->done) {
+        embedded_cli_redraw_line(cli);
+        return;
+    }
+    cli_puts(cli, MOVE_BOL CLEAR_EOL);
+    cli_puts(cli, cli->prompt);
+    if (!cli->tx_prompted) {
+        // The line has been finished, but not yet handled
+        cli_puts(cli, cli->buffer);
+        cli_putchar(cli, '\n', true);
+    }
+}
+#endif
+
+static bool is_whitespace(char ch)
+{
+    return (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r');
+}
+
+#if EMBEDDED_CLI_LINKER_COMMANDS
+/**
+ * Bounds of the table of EMBEDDED_CLI_COMMAND entries, as defined by
+ * embedded_cli_commands.ld
+ */
+extern const struct embedded_cli_command
+    *const embedded_cli_commands_start[];
+extern const struct embedded_cli_command *const embedded_cli_commands_end[];
+
+#define LINKER_COMMAND_COUNT                                                 \
+    ((size_t)(embedded_cli_commands_end - embedded_cli_commands_start))
+#endif
+
+#if EMBEDDED_CLI_MAX_COMMANDS || EMBEDDED_CLI_LINKER_COMMANDS
+/**
+ * Binary search a table of commands, sorted by name, comparing the first
+ * len characters of each name against name
+ * @param after If false, find the first command which is not less than
+ * name. If true, find the first which is greater than name.
+ */
+static size_t
+embedded_cli_command_bound(const struct embedded_cli_command *const *commands,
+                           size_t count, const char *name, size_t len,
+                           bool after)
+{
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strncmp(commands[mid]->name, name, len);
+        if (cmp < 0 || (after && cmp == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Binary search a table of commands, sorted by name, for name
+ * @return index of the command, or where it should be inserted if it
+ * doesn't exist
+ */
+static size_t
+embedded_cli_command_pos(const struct embedded_cli_command *const *commands,
+                         size_t count, const char *name)
+{
+    // Include the nul terminator so this is an exact match
+    return embedded_cli_command_bound(commands, count, name, strlen(name) + 1,
+                                      false);
+}
+
+static const struct embedded_cli_command *
+embedded_cli_command_search(const struct embedded_cli_command *const *commands,
+                            size_t count, const char *name)
+{
+    size_t pos = embedded_cli_command_pos(commands, count, name);
+    if (pos < count && strcmp(commands[pos]->name, name) == 0)
+        return commands[pos];
+    return NULL;
+}
+
+/**
+ * The commands in a table which start with a given prefix. As the tables
+ * are sorted, these are always contiguous
+ */
+struct command_range {
+    const struct embedded_cli_command *const *commands;
+    size_t pos;
+    size_t end;
+};
+
+static size_t
+embedded_cli_command_ranges(const struct embedded_cli *cli, const char *prefix,
+                            size_t len, struct command_range *ranges)
+{
+    size_t count = 0;
+#if EMBEDDED_CLI_MAX_COMMANDS
+    ranges[count].commands = cli->commands;
+    ranges[count].pos = embedded_cli_command_bound(
+        cli->commands, cli->command_count, prefix, len, false);
+    ranges[count].end = embedded_cli_command_bound(
+        cli->commands, cli->command_count, prefix, len, true);
+    count++;
+#else
+    (void)cli;
+#endif
+#if EMBEDDED_CLI_LINKER_COMMANDS
+    ranges[count].commands = embedded_cli_commands_start;
+    ranges[count].pos = embedded_cli_command_bound(
+        embedded_cli_commands_start, LINKER_COMMAND_COUNT, prefix, len, false);
+    ranges[count].end = embedded_cli_command_bound(
+        embedded_cli_commands_start, LINKER_COMMAND_COUNT, prefix, len, true);
+    count++;
+#endif
+    return count;
+}
+
+/**
+ * Retrieve the next command name, in order, from a set of ranges.
+ * @return NULL when they are exhausted
+ */
+static const char *embedded_cli_next_command(struct command_range *ranges,
+                                             size_t count)
+{
+    const char *name = NULL;
+    for (size_t i = 0; i < count; i++) {
+        if (ranges[i].pos < ranges[i].end &&
+            (!name ||
+             strcmp(ranges[i].commands[ranges[i].pos]->name, name) < 0))
+            name = ranges[i].commands[ranges[i].pos]->name;
+    }
+    // Step past this name in every table, so duplicates are skipped
+    for (size_t i = 0; name && i < count; i++) {
+        if (ranges[i].pos < ranges[i].end &&
+            strcmp(ranges[i].commands[ranges[i].pos]->name, name) == 0)
+            ranges[i].pos++;
+    }
+    return name;
+}
+
+/**
+ * Complete the command name at the cursor, or if list is set and there is
+ * more than one possibility, display them all
+ */
+static void embedded_cli_complete(struct embedded_cli *cli, bool list)
+{
+    struct command_range ranges[2];
+    size_t nranges;
+    size_t start = 0;
+    size_t common = 0;
+    int count = 0;
+    const char *first = NULL;
+    const char *name;
+
+    // Only the command itself (ie: the first argument) is completed
+    while (start < cli->cursor && is_whitespace(cli->buffer[start]))
+        start++;
+    for (size_t i = start; i < cli->cursor; i++)
+        if (is_whitespace(cli->buffer[i]))
+            return;
+
+    nranges = embedded_cli_command_ranges(cli, &cli->buffer[start],
+                                          cli->cursor - start, ranges);
+    while ((name = embedded_cli_next_command(ranges, nranges)) != NULL) {
+        size_t i = 0;
+        if (!first)
+            first = name;
+        while (i < common && first[i] == name[i])
+            i++;
+        common = count == 0 ? strlen(name) : i;
+        count++;
+    }
+
+    if (list && count > 1) {
+        nranges = embedded_cli_command_ranges(cli, &cli->buffer[start],
+                                              cli->cursor - start, ranges);
+        cli_puts(cli, "\n");
+        while ((name = embedded_cli_next_command(ranges, nranges)) != NULL) {
+            cli_puts(cli, name);
+            cli_puts(cli, "  ");
+        }
+        cli_puts(cli, "\n");
+        cli_puts(cli, cli->prompt);
+        cli->screen_cursor = cli->screen_len = 0;
+        embedded_cli_refresh(cli, 0);
+        return;
+    }
+
+    if (common > cli->cursor - start)
+        embedded_cli_insert_run(cli, &first[cli->cursor - start],
+                                common - (cli->cursor - start));
+    if (count == 1 && cli->buffer[cli->cursor] != ' ')
+        embedded_cli_insert_default_char(cli, ' ');
+}
+#endif
+
+#if EMBEDDED_CLI_BATCH_MODE
+/**
+ * Adds input to the line in batch mode, stopping after a newline
+ * @return Number of bytes used
+ */
+static size_t embedded_cli_batch_block(struct embedded_cli *cli,
+                                       const char *buf, size_t len)
+{
+    const char *end;
+    size_t n, room = CLI_LINE_SIZE(cli) - 1 - cli->len;
+    size_t skip = 0;
+
+#if EMBEDDED_CLI_SERIAL_XLATE
+    // A CR NL pair is a single line ending, even if it is split between
+    // blocks
+    if (cli->batch_cr && len > 0) {
+        cli->batch_cr = false;
+        if (buf[0] == '\n') {
+            skip = 1;
+            buf++;
+            len--;
+        }
+    }
+#endif
+    end = memchr(buf, '\n', len);
+#if EMBEDDED_CLI_SERIAL_XLATE
+    {
+        const char *cr = memchr(buf, '\r', end ? (size_t)(end - buf) : len);
+        if (cr)
+            end = cr;
+    }
+#endif
+    n = end ? (size_t)(end - buf) : len;
+
+    if (cli->done) {
+        cli->buffer[0] = '\0';
+        cli->done = false;
+    }
+    // Drop anything that won't fit
+    memcpy(&cli->buffer[cli->len], buf, n < room ? n : room);
+    cli->len = (embedded_cli_line_index_t)(cli->len + (n < room ? n : room));
+    cli->cursor = cli->len;
+    if (!end) {
+        cli->buffer[cli->len] = '\0';
+        CLI_STAT(cli, chars, skip + len);
+        return skip + len;
+    }
+#if EMBEDDED_CLI_SERIAL_XLATE
+    cli->batch_cr = *end == '\r';
+#else
+    if (cli->len > 0 && cli->buffer[cli->len - 1] == '\r')
+        cli->len--;
+#endif
+    cli->buffer[cli->len] = '\0';
+    cli->done = true;
+    CLI_STAT(cli, chars, skip + n + 1);
+    CLI_STAT(cli, lines, 1);
+    embedded_cli_reset_line(cli);
+    return skip + n + 1;
+}
+#endif
+
+/**
+ * Types of character within CSI & SS3 sequences
+ */
+enum {
+    ESC_CLASS_DIGIT,
+    ESC_CLASS_SEPARATOR, // ; or :
+    ESC_CLASS_MARKER,    // Private marker or intermediate byte
+    ESC_CLASS_FINAL,
+    ESC_CLASS_CONTROL, // Anything else, which can't be part of a sequence
+};
+
+/**
+ * Next state for each state from ESC_CSI onwards, and class of character
+ */
+static const uint8_t escape_next[][ESC_CLASS_CONTROL + 1] = {
+    // ESC_CSI
+    {ESC_CSI, ESC_CSI_MOD, ESC_CSI_SKIP, ESC_FINAL, ESC_ABORT},
+    // ESC_CSI_MOD
+    {ESC_CSI_MOD, ESC_CSI_SKIP, ESC_CSI_SKIP, ESC_FINAL, ESC_ABORT},
+    // ESC_CSI_SKIP
+    {ESC_CSI_SKIP, ESC_CSI_SKIP, ESC_CSI_SKIP, ESC_FINAL, ESC_ABORT},
+    // ESC_SS3, where old xterms put the modifier before the final byte
+    {ESC_SS3, ESC_CSI_SKIP, ESC_CSI_SKIP, ESC_FINAL, ESC_ABORT},
+};
+
+/**
+ * Editor actions which escape sequences decode to
+ */
+enum {
+    KEY_NONE,
+    KEY_UP,
+    KEY_DOWN,
+    KEY_RIGHT,
+    KEY_LEFT,
+    KEY_HOME,
+    KEY_END,
+    KEY_DELETE,
+    KEY_WORD_RIGHT,
+    KEY_WORD_LEFT,
+    KEY_PASTE_START,
+    KEY_PASTE_END,
+    KEY_TILDE, // Key is given by the first parameter
+};
+
+/**
+ * Action for each final byte of a CSI or SS3 sequence, from '@'
+ */
+static const uint8_t escape_keys['~' - '@' + 1] = {
+    ['A' - '@'] = KEY_UP,         ['B' - '@'] = KEY_DOWN,
+    ['C' - '@'] = KEY_RIGHT,      ['D' - '@'] = KEY_LEFT,
+    ['F' - '@'] = KEY_END,        ['H' - '@'] = KEY_HOME,
+    ['c' - '@'] = KEY_WORD_RIGHT, ['d' - '@'] = KEY_WORD_LEFT, // rxvt
+    ['~' - '@'] = KEY_TILDE,
+};
+
+/**
+ * Action for each ESC [ n ~ sequence. 1 & 4 are sent by PuTTY and the Linux
+ * console, 7 & 8 by rxvt
+ */
+static const uint8_t tilde_keys[] = {
+    [1] = KEY_HOME, [3] = KEY_DELETE, [4] = KEY_END,
+    [7] = KEY_HOME, [8] = KEY_END,
+};
+
+static uint8_t escape_class(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ESC_CLASS_DIGIT;
+    if (ch == ';' || ch == ':')
+        return ESC_CLASS_SEPARATOR;
+    if ((ch >= ' ' && ch <= '/') || (ch >= '<' && ch <= '?'))
+        return ESC_CLASS_MARKER;
+    if (ch >= '@' && ch <= '~')
+        return ESC_CLASS_FINAL;
+    return ESC_CLASS_CONTROL;
+}
+
+/**
+ * Work out the action for a complete CSI or SS3 sequence, ending in ch
+ */
+static uint8_t embedded_cli_escape_key(const struct embedded_cli *cli,
+                                       char ch)
+{
+    uint8_t key;
+
+    if (cli->escape == ESC_CSI_SKIP)
+        return KEY_NONE;
+    key = escape_keys[ch - '@'];
+    if (key == KEY_TILDE) {
+        if (cli->counter < sizeof(tilde_keys))
+            key = tilde_keys[cli->counter];
+        else if (cli->counter == 200)
+            key = KEY_PASTE_START;
+        else if (cli->counter == 201)
+            key = KEY_PASTE_END;
+        else
+            key = KEY_NONE;
+    }
+    // The modifier is 1 + the keys held down: 1 for shift, 2 for alt and 4
+    // for ctrl. Alt or ctrl with left/right moves a word at a time
+    if (cli->modifier > 1 && ((cli->modifier - 1) & 6)) {
+        if (key == KEY_RIGHT)
+            key = KEY_WORD_RIGHT;
+        else if (key == KEY_LEFT)
+            key = KEY_WORD_LEFT;
+    }
+    return key;
+}
+
+/**
+ * Carry out the action for an escape sequence
+ * @param count Number of times to repeat cursor movement
+ */
+static void embedded_cli_escape_action(struct embedded_cli *cli, uint8_t key,
+                                       size_t count)
+{
+    switch (key) {
+    case KEY_UP: {
+#if EMBEDDED_CLI_HISTORY_LEN
+        const char *line = embedded_cli_get_history(cli, cli->history_pos);
+        if (line) {
+            cli->history_pos++;
+            embedded_cli_set_line(cli, line);
+        } else {
+            // We don't want to wrap this history, so retain history_pos
+            embedded_cli_set_line(cli, "");
+        }
+#endif
+        break;
+    }
+
+    case KEY_DOWN: {
+#if EMBEDDED_CLI_HISTORY_LEN
+        const char *line =
+            embedded_cli_get_history(cli, cli->history_pos - 2);
+        if (line) {
+            cli->history_pos--;
+            embedded_cli_set_line(cli, line);
+        } else {
+            cli->history_pos = 0;
+            embedded_cli_set_line(cli, "");
+        }
+#endif
+        break;
+    }
+
+    case KEY_RIGHT:
+        if (cli->cursor + count <= cli->len) {
+            cli->cursor = (embedded_cli_line_index_t)(cli->cursor + count);
+            embedded_cli_refresh(cli, cli->len);
+        }
+        break;
+    case KEY_LEFT:
+        if (cli->cursor >= count) {
+            cli->cursor = (embedded_cli_line_index_t)(cli->cursor - count);
+            embedded_cli_refresh(cli, cli->len);
+        }
+        break;
+    case KEY_WORD_RIGHT:
+        while (cli->cursor < cli->len && cli->buffer[cli->cursor] == ' ')
+            cli->cursor++;
+        while (cli->cursor < cli->len && cli->buffer[cli->cursor] != ' ')
+            cli->cursor++;
+        embedded_cli_refresh(cli, cli->len);
+        break;
+    case KEY_WORD_LEFT:
+        while (cli->cursor > 0 && cli->buffer[cli->cursor - 1] == ' ')
+            cli->cursor--;
+        while (cli->cursor > 0 && cli->buffer[cli->cursor - 1] != ' ')
+            cli->cursor--;
+        embedded_cli_refresh(cli, cli->len);
+        break;
+    case KEY_END:
+        cli->cursor = cli->len;
+        embedded_cli_refresh(cli, cli->len);
+        break;
+    case KEY_HOME:
+        cli->cursor = 0;
+        embedded_cli_refresh(cli, cli->len);
+        break;
+    case KEY_DELETE:
+        if (cli->cursor < cli->len) {
+            CLI_STAT(cli, memmove_bytes, cli->len - cli->cursor);
+            memmove(&cli->buffer[cli->cursor], &cli->buffer[cli->cursor + 1],
+                    (size_t)cli->len - cli->cursor);
+            cli->len--;
+            embedded_cli_refresh(cli, cli->cursor);
+        }
+        break;
+#if EMBEDDED_CLI_BRACKETED_PASTE
+    case KEY_PASTE_START:
+        cli->pasting = true;
+        break;
+    case KEY_PASTE_END:
+        cli->pasting = false;
+        if (!cli->defer_output)
+            embedded_cli_sync(cli);
+        break;
 #endif
-    {
-        cli_puts(cli, &cli->buffer[cli->cursor - 1]);
-        term_cursor_back(cli, cli->len - cli->cursor);
     }
 }
 
-const char *embedded_cli_get_history(struct embedded_cli *cli,
-                                     int history_pos)
+/**
+ * Pass a character to the escape sequence decoder, carrying out the
+ * sequence's action once it is complete. Each character costs a couple of
+ * table lookups, however long the sequence is
+ * @return false if the character isn't part of the sequence, and should be
+ * processed as normal
+ */
+static bool embedded_cli_escape_char(struct embedded_cli *cli, char ch)
 {
-#if EMBEDDED_CLI_HISTORY_LEN
-    size_t pos = 0;
-
-    if (history_pos < 0)
-        return NULL;
+    uint8_t next, key;
+    size_t count;
 
-    // Search back through the history buffer for `history_pos` entry
-    for (int i = 0; i < history_pos; i++) {
-        size_t len = strlen(&cli->history[pos]);
-        if (len == 0)
-            return NULL;
-        pos += len + 1;
-        if (pos >= sizeof(cli->history))
-            return NULL;
+    if (cli->escape == ESC_START) {
+        switch (ch) {
+        case '[':
+            next = ESC_CSI;
+            break;
+        case 'O':
+            next = ESC_SS3;
+            break;
+        case 'b': // Meta-b / Meta-f, as sent for alt-left/right by macOS
+        case 'f':
+            next = ESC_FINAL;
+            break;
+        default:
+            next = ESC_ABORT;
+            break;
+        }
+    } else {
+        next = escape_next[cli->escape - ESC_CSI][escape_class(ch)];
     }
 
-    if (cli->history[pos] == '\0')
-        return NULL;
+    if (next == ESC_ABORT) {
+        cli->escape = ESC_NONE;
+        return false;
+    }
+    if (next != ESC_FINAL) {
+        if (ch >= '0' && ch <= '9') {
+            // Parameters past 999 (or modifiers past 99) aren't keys we
+            // know, and would overflow
+            size_t digit = (size_t)(ch - '0');
+            if (next == ESC_CSI && cli->counter < 100)
+                cli->counter =
+                    (embedded_cli_counter_t)(cli->counter * 10 + digit);
+            else if (next != ESC_CSI && cli->modifier < 10)
+                cli->modifier = (uint8_t)(cli->modifier * 10 + digit);
+            else
+                next = ESC_CSI_SKIP;
+        }
+        cli->escape = next;
+        return true;
+    }
 
-    return &cli->history[pos];
-#else
-    (void)cli;
-    (void)history_pos;
-    return NULL;
+    if (cli->escape == ESC_START)
+        key = ch == 'b' ? KEY_WORD_LEFT : KEY_WORD_RIGHT;
+    else
+        key = embedded_cli_escape_key(cli, ch);
+#if EMBEDDED_CLI_BRACKETED_PASTE
+    // The only sequence which means anything in a paste is the end
+    if (cli->pasting && key != KEY_PASTE_END)
+        key = KEY_NONE;
 #endif
+    count = cli->counter ? cli->counter : 1;
+    cli->escape = ESC_NONE;
+    cli->counter = 0;
+    cli->modifier = 0;
+    CLI_STAT(cli, escapes, 1);
+    embedded_cli_escape_action(cli, key, count);
+    return true;
 }
 
-#if EMBEDDED_CLI_HISTORY_LEN
-static void embedded_cli_extend_history(struct embedded_cli *cli)
-{
-    size_t len = strlen(cli->buffer);
-    if (len > 0) {
-        // If the new entry is the same as the most recent history entry,
-        // then don't insert it
-        if (strcmp(cli->buffer, cli->history) == 0)
-            return;
-        memmove(&cli->history[len + 1], &cli->history[0],
-                sizeof(cli->history) - (len + 1));
-        memcpy(cli->history, cli->buffer, len + 1);
-        // Make sure it's always nul terminated
-        cli->history[sizeof(cli->history) - 1] = '\0';
-    }
-}
-
-static void embedded_cli_stop_search(struct embedded_cli *cli, bool print)
+static bool embedded_cli_process_char(struct embedded_cli *cli, char ch)
 {
-    const char *h = embedded_cli_get_history_search(cli);
-    if (h) {
-        strncpy(cli->buffer, h, sizeof(cli->buffer));
-        cli->buffer[sizeof(cli->buffer) - 1] = '\0';
-    } else
-        cli->buffer[0] = '\0';
-    cli->len = cli->cursor = strlen(cli->buffer);
-    cli->searching = false;
-    if (print) {
-        cli_puts(cli, MOVE_BOL CLEAR_EOL);
-        cli_puts(cli, cli->prompt);
-        cli_puts(cli, cli->buffer);
+#if EMBEDDED_CLI_BATCH_MODE
+    if (cli->batch) {
+        embedded_cli_batch_block(cli, &ch, 1);
+        return cli->done;
     }
-}
 #endif
-
-bool embedded_cli_insert_char(struct embedded_cli *cli, char ch)
-{
+#if EMBEDDED_CLI_MAX_COMMANDS || EMBEDDED_CLI_LINKER_COMMANDS
+    bool tabbed = cli->tabbed;
+    cli->tabbed = false;
+#endif
+    CLI_STAT(cli, chars, 1);
     // If we're inserting a character just after a finished line, clear things
     // up
     if (cli->done) {
         cli->buffer[0] = '\0';
         cli->done = false;
     }
-    // printf("Inserting char %d 0x%x '%c'\n", ch, ch, ch);
-    if (cli->have_csi) {
-        if (ch >= '0' && ch <= '9' && cli->counter < 100) {
-            cli->counter = (cli->counter * 10) + (size_t)(ch - '0');
-            // printf("cli->counter -> %d\n", cli->counter);
-        } else {
-            if (cli->counter == 0)
-                cli->counter = 1;
-            switch (ch) {
-            case 'A': { // up arrow
-#if EMBEDDED_CLI_HISTORY_LEN
-                // Backspace over our current line
-                term_backspace(cli, cli->done ? 0 : cli->cursor);
-                const char *line =
-                    embedded_cli_get_history(cli, cli->history_pos + 1);
-                if (line) {
-                    size_t len = strlen(line);
-                    cli->history_pos++;
-                    // printf("history up %d = '%s'\n", cli->history_pos,
-                    // line);
-                    strncpy(cli->buffer, line, sizeof(cli->buffer));
-                    cli->buffer[sizeof(cli->buffer) - 1] = '\0';
-                    cli->len = len;
-                    cli->cursor = len;
-                    cli_puts(cli, cli->buffer);
-                    cli_puts(cli, CLEAR_EOL);
-                } else {
-                    int tmp = cli->history_pos; // We don't want to wrap this
-                                                // history, so retain it
-                    cli->buffer[0] = '\0';
-                    embedded_cli_reset_line(cli);
-                    cli->history_pos = tmp;
-                    cli_puts(cli, CLEAR_EOL);
-                }
-#endif
-                break;
-            }
-
-            case 'B': { // down arrow
-#if EMBEDDED_CLI_HISTORY_LEN
-                term_backspace(cli, cli->done ? 0 : cli->cursor);
-                const char *line =
-                    embedded_cli_get_history(cli, cli->history_pos - 1);
-                if (line) {
-                    size_t len = strlen(line);
-                    cli->history_pos--;
-                    // printf("history down %d = '%s'\n",
-                    // cli->history_pos, line);
-                    strncpy(cli->buffer, line, sizeof(cli->buffer));
-                    cli->buffer[sizeof(cli->buffer) - 1] = '\0';
-                    cli->len = len;
-                    cli->cursor = len;
-                    cli_puts(cli, cli->buffer);
-                    cli_puts(cli, CLEAR_EOL);
-                } else {
-                    cli->buffer[0] = '\0';
-                    embedded_cli_reset_line(cli);
-                    cli_puts(cli, CLEAR_EOL);
-                }
+#if EMBEDDED_CLI_BRACKETED_PASTE
+    // Pasted text is taken literally, apart from line endings, so that it
+    // can't trigger any editing. Ctrl-C still works, in case the end of
+    // the paste goes missing
+    if (cli->pasting) {
+        if (ch == '\t')
+            ch = ' ';
+        else if (ch >= 0 && ch < 32 && ch != '\r' && ch != '\n' &&
+                 ch != '\x1b' && ch != '\x03')
+            return false;
+    }
 #endif
-                break;
-            }
-
-            case 'C':
-                if (cli->cursor + cli->counter <= cli->len) {
-                    cli->cursor += cli->counter;
-                    term_cursor_fwd(cli, cli->counter);
-                }
-                break;
-            case 'D':
-                // printf("back %d vs %d\n", cli->cursor, cli->counter);
-                if (cli->cursor >= cli->counter) {
-                    cli->cursor -= cli->counter;
-                    term_cursor_back(cli, cli->counter);
-                }
-                break;
-            case 'F':
-                term_cursor_fwd(cli, cli->len - cli->cursor);
-                cli->cursor = cli->len;
-                break;
-            case 'H':
-                term_cursor_back(cli, cli->cursor);
-                cli->cursor = 0;
-                break;
-            case '~':
-                if (cli->counter == 3) { // delete key
-                    if (cli->cursor < cli->len) {
-                        memmove(&cli->buffer[cli->cursor],
-                                &cli->buffer[cli->cursor + 1],
-                                cli->len - cli->cursor);
-                        cli->len--;
-                        cli_puts(cli, &cli->buffer[cli->cursor]);
-                        cli_puts(cli, " ");
-                        term_cursor_back(cli, cli->len - cli->cursor + 1);
-                    }
-                }
-                break;
-            default:
-                // TODO: Handle more escape sequences
-                break;
-            }
-            cli->have_csi = cli->have_escape = false;
-            cli->counter = 0;
-        }
-    } else {
+    if (cli->escape == ESC_NONE || !embedded_cli_escape_char(cli, ch)) {
         switch (ch) {
         case '\0':
             break;
         case '\x01':
             // Go to the beginning of the line
-            term_cursor_back(cli, cli->cursor);
             cli->cursor = 0;
+            embedded_cli_refresh(cli, cli->len);
             break;
         case '\x03':
+#if EMBEDDED_CLI_BRACKETED_PASTE
+            cli->pasting = false;
+#endif
             cli_puts(cli, "^C\n");
             cli_puts(cli, cli->prompt);
             embedded_cli_reset_line(cli);
             cli->buffer[0] = '\0';
             break;
         case '\x05': // Ctrl-E
-            term_cursor_fwd(cli, cli->len - cli->cursor);
             cli->cursor = cli->len;
+            embedded_cli_refresh(cli, cli->len);
             break;
         case '\x0b': // Ctrl-K
-            cli_puts(cli, CLEAR_EOL);
             cli->buffer[cli->cursor] = '\0';
             cli->len = cli->cursor;
+            embedded_cli_refresh(cli, cli->cursor);
             break;
         case '\x0c': // Ctrl-L
-            cli_puts(cli, MOVE_BOL CLEAR_EOL);
-            cli_puts(cli, cli->prompt);
-            cli_puts(cli, cli->buffer);
-            term_cursor_back(cli, cli->len - cli->cursor);
+            embedded_cli_redraw_line(cli);
             break;
         case '\b': // Backspace
         case 0x7f: // backspace?
@@ -345,15 +1651,13 @@ bool embedded_cli_insert_char(struct embedded_cli *cli, char ch)
                 embedded_cli_stop_search(cli, true);
 #endif
             if (cli->cursor > 0) {
+                CLI_STAT(cli, memmove_bytes, cli->len - cli->cursor + 1);
                 memmove(&cli->buffer[cli->cursor - 1],
                         &cli->buffer[cli->cursor],
-                        cli->len - cli->cursor + 1);
+                        (size_t)cli->len - cli->cursor + 1);
                 cli->cursor--;
                 cli->len--;
-                term_cursor_back(cli, 1);
-                cli_puts(cli, &cli->buffer[cli->cursor]);
-                cli_puts(cli, " ");
-                term_cursor_back(cli, cli->len - cli->cursor + 1);
+                embedded_cli_refresh(cli, cli->cursor);
             }
             break;
         case CTRL_R:
@@ -361,36 +1665,45 @@ bool embedded_cli_insert_char(struct embedded_cli *cli, char ch)
             if (!cli->searching) {
                 cli_puts(cli, "\nsearch:");
                 cli->searching = true;
+                embedded_cli_history_search(cli, 0);
+            } else if (cli->search_pos > 0) {
+                // Step back to the next older match, if there is one
+                int prev = cli->search_pos;
+                embedded_cli_history_search(cli, prev);
+                if (cli->search_pos == 0)
+                    cli->search_pos = (embedded_cli_history_pos_t)prev;
+                embedded_cli_show_search(cli);
             }
 #endif
             break;
+#if EMBEDDED_CLI_MAX_COMMANDS || EMBEDDED_CLI_LINKER_COMMANDS
+        case '\t':
+#if EMBEDDED_CLI_HISTORY_LEN
+            if (cli->searching)
+                break;
+#endif
+            // A second tab in a row lists the possibilities
+            embedded_cli_complete(cli, tabbed);
+            cli->tabbed = true;
+            break;
+#endif
         case '\x1b':
 #if EMBEDDED_CLI_HISTORY_LEN
             if (cli->searching)
                 embedded_cli_stop_search(cli, true);
 #endif
-            cli->have_csi = false;
-            cli->have_escape = true;
+            cli->escape = ESC_START;
             cli->counter = 0;
+            cli->modifier = 0;
             break;
         case '\x15': // Ctrl-U
             // move back data after cursor, including last \0
+            CLI_STAT(cli, memmove_bytes, cli->len - cli->cursor + 1);
             memmove(cli->buffer, cli->buffer + cli->cursor,
-                    cli->len - cli->cursor + 1);
+                    (size_t)cli->len - cli->cursor + 1);
             cli->len = cli->len - cli->cursor;
-            // clear from beggining of buffer,
-            // print buffer again and move back to start
-            term_cursor_back(cli, cli->cursor);
-            cli_puts(cli, CLEAR_EOL);
-            cli_puts(cli, cli->buffer);
-            term_cursor_back(cli, cli->len);
             cli->cursor = 0;
-            break;
-        case '[':
-            if (cli->have_escape)
-                cli->have_csi = true;
-            else
-                embedded_cli_insert_default_char(cli, ch);
+            embedded_cli_refresh(cli, 0);
             break;
 #if EMBEDDED_CLI_SERIAL_XLATE
         case '\r':
@@ -408,6 +1721,7 @@ bool embedded_cli_insert_char(struct embedded_cli *cli, char ch)
     cli->done = (ch == '\n');
 
     if (cli->done) {
+        CLI_STAT(cli, lines, 1);
 #if EMBEDDED_CLI_HISTORY_LEN
         if (cli->searching)
             embedded_cli_stop_search(cli, false);
@@ -419,6 +1733,210 @@ bool embedded_cli_insert_char(struct embedded_cli *cli, char ch)
     return cli->done;
 }
 
+bool embedded_cli_insert_char(struct embedded_cli *cli, char ch)
+{
+    bool done = embedded_cli_process_char(cli, ch);
+    cli_flush(cli);
+    return done;
+}
+
+static bool is_control(char ch)
+{
+    return (unsigned char)ch < 32 || ch == 0x7f;
+}
+
+#define BYTES_ONES ((size_t)-1 / 0xff)
+#define BYTES_HIGH (BYTES_ONES * 0x80)
+
+/**
+ * Determine if any byte in the word is a control character. Bytes with the
+ * top bit set are not considered control characters (they're UTF-8)
+ */
+static bool word_has_control(size_t w)
+{
+    size_t below_space = (w - BYTES_ONES * 0x20) & ~w & BYTES_HIGH;
+    size_t del = w ^ (BYTES_ONES * 0x7f);
+    del = (del - BYTES_ONES) & ~del & BYTES_HIGH;
+    return (below_space | del) != 0;
+}
+
+/**
+ * Returns the number of bytes at the start of buf which are plain
+ * characters, checking a word at a time where possible
+ */
+static size_t embedded_cli_printable_run(const char *buf, size_t len)
+{
+    size_t pos = 0;
+    for (; pos + sizeof(size_t) <= len; pos += sizeof(size_t)) {
+        size_t word;
+        memcpy(&word, &buf[pos], sizeof(word));
+        if (word_has_control(word))
+            break;
+    }
+    while (pos < len && !is_control(buf[pos]))
+        pos++;
+    return pos;
+}
+
+/**
+ * Process a block of input, stopping once a full line is available
+ * @return number of bytes consumed
+ */
+static size_t embedded_cli_process_block(struct embedded_cli *cli,
+                                         const char *buf, size_t len)
+{
+    size_t pos = 0;
+#if EMBEDDED_CLI_BATCH_MODE
+    if (cli->batch)
+        return embedded_cli_batch_block(cli, buf, len);
+#endif
+    while (pos < len) {
+        // Outside of escape sequences, runs of plain text can be inserted
+        // in a single operation
+        if (cli->escape == ESC_NONE) {
+            size_t run = embedded_cli_printable_run(&buf[pos], len - pos);
+            if (run > 0) {
+                if (cli->done) {
+                    cli->buffer[0] = '\0';
+                    cli->done = false;
+                }
+#if EMBEDDED_CLI_MAX_COMMANDS || EMBEDDED_CLI_LINKER_COMMANDS
+                // As with single keys, text ends a completion, so the next
+                // tab doesn't list the possibilities
+                cli->tabbed = false;
+#endif
+                CLI_STAT(cli, chars, run);
+                embedded_cli_insert_run(cli, &buf[pos], run);
+                pos += run;
+                continue;
+            }
+        }
+        if (embedded_cli_process_char(cli, buf[pos++]))
+            break;
+    }
+    return pos;
+}
+
+size_t embedded_cli_insert_buffer(struct embedded_cli *cli, const char *buf,
+                                  size_t len)
+{
+    bool defer = cli->defer_output;
+    size_t pos;
+    // Only update the screen once the whole block has been processed
+    cli->defer_output = true;
+    pos = embedded_cli_process_block(cli, buf, len);
+    embedded_cli_set_input_pending(cli, defer);
+    return pos;
+}
+
+#if EMBEDDED_CLI_RX_BUF_LEN
+bool embedded_cli_isr_push(struct embedded_cli *cli, char ch)
+{
+    size_t head = cli->rx_head;
+    size_t next = (head + 1) % EMBEDDED_CLI_RX_BUF_LEN;
+    if (next == cli->rx_tail)
+        return false;
+    cli->rx_buf[head] = ch;
+    // Make sure the character is visible before the new head
+    EMBEDDED_CLI_BARRIER();
+    cli->rx_head = (embedded_cli_rx_index_t)next;
+    return true;
+}
+
+bool embedded_cli_poll(struct embedded_cli *cli)
+{
+    bool defer = cli->defer_output;
+    bool done = false;
+    // Only update the screen once everything queued has been processed
+    cli->defer_output = true;
+    while (!done) {
+        size_t head = cli->rx_head;
+        size_t tail = cli->rx_tail;
+        size_t len;
+        if (head == tail)
+            break;
+        EMBEDDED_CLI_BARRIER();
+        // Process up to the end of the buffer, or the head, whichever is
+        // first
+        len = (head > tail ? head : EMBEDDED_CLI_RX_BUF_LEN) - tail;
+        len = embedded_cli_process_block(cli, &cli->rx_buf[tail], len);
+        done = cli->done;
+        // Make sure we're done with the characters before releasing them
+        EMBEDDED_CLI_BARRIER();
+        cli->rx_tail =
+            (embedded_cli_rx_index_t)((tail + len) % EMBEDDED_CLI_RX_BUF_LEN);
+    }
+    embedded_cli_set_input_pending(cli, defer);
+    return done;
+}
+#endif
+
+#if EMBEDDED_CLI_BATCH_MODE
+void embedded_cli_set_batch(struct embedded_cli *cli, bool batch)
+{
+    // Any half finished escape sequence or search is abandoned
+    cli->escape = ESC_NONE;
+    cli->counter = 0;
+    cli->modifier = 0;
+#if EMBEDDED_CLI_HISTORY_LEN
+    cli->searching = false;
+    cli->history_pos = 0;
+#endif
+#if EMBEDDED_CLI_SERIAL_XLATE
+    cli->batch_cr = false;
+#endif
+#if EMBEDDED_CLI_BRACKETED_PASTE
+    cli->pasting = false;
+#endif
+    // Bring the screen up to date with anything held back, rather than
+    // leaving it to the next key
+    cli->defer_output = false;
+    embedded_cli_sync(cli);
+    cli_flush(cli);
+    cli->batch = batch;
+}
+#endif
+
+void embedded_cli_set_input_pending(struct embedded_cli *cli, bool pending)
+{
+    cli->defer_output = pending;
+    if (!pending) {
+        embedded_cli_sync(cli);
+        cli_flush(cli);
+    }
+}
+
+#if EMBEDDED_CLI_TX_BUF_LEN
+void embedded_cli_set_tx_policy(struct embedded_cli *cli,
+                                enum embedded_cli_tx_policy policy,
+                                void (*tx_wait)(void *data))
+{
+    cli_flush(cli);
+    cli->tx_policy = (uint8_t)policy;
+    cli->tx_wait = tx_wait;
+}
+
+size_t embedded_cli_tx_peek(struct embedded_cli *cli, const char **data)
+{
+    size_t head = cli->tx_head;
+    size_t tail = cli->tx_tail;
+    // Make sure the characters are visible before we hand them out
+    EMBEDDED_CLI_BARRIER();
+    *data = &cli->tx_buf[tail];
+    // Stop at the end of the buffer, so the block is contiguous
+    return (head >= tail ? head : EMBEDDED_CLI_TX_BUF_LEN) - tail;
+}
+
+void embedded_cli_tx_ack(struct embedded_cli *cli, size_t len)
+{
+    size_t tail = cli->tx_tail;
+    // Make sure we're done with the characters before releasing them
+    EMBEDDED_CLI_BARRIER();
+    cli->tx_tail =
+        (embedded_cli_tx_index_t)((tail + len) % EMBEDDED_CLI_TX_BUF_LEN);
+}
+#endif
+
 const char *embedded_cli_get_line(const struct embedded_cli *cli)
 {
     if (!cli->done)
@@ -426,76 +1944,130 @@ const char *embedded_cli_get_line(const struct embedded_cli *cli)
     return cli->buffer;
 }
 
-static bool is_whitespace(char ch)
-{
-    return (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r');
-}
-
-int embedded_cli_argc(struct embedded_cli *cli, char ***argv)
+/**
+ * Find the extent of the next argument in buf, starting from *pos. On
+ * return *pos is just after the whitespace following the argument
+ * @return false if there are no more arguments
+ */
+static bool embedded_cli_next_arg(const char *buf, size_t size, size_t *pos,
+                                  struct embedded_cli_arg *arg)
 {
-    int pos = 0;
-    bool in_arg = false;
-    bool in_escape = false;
+    size_t i = *pos;
     char in_string = '\0';
-    if (!cli->done)
-        return 0;
-    for (size_t i = 0; i < sizeof(cli->buffer) && cli->buffer[i] != '\0';) {
-        // If we're escaping this character, just absorb it regardless
-        if (in_escape) {
-            in_escape = false;
-            i++;
-            continue;
-        }
 
+    while (i < size && buf[i] != '\0' && is_whitespace(buf[i]))
+        i++;
+    if (i >= size || buf[i] == '\0') {
+        *pos = i;
+        return false;
+    }
+
+    arg->offset = i;
+    arg->flags = 0;
+    for (; i < size && buf[i] != '\0'; i++) {
+        char ch = buf[i];
         if (in_string) {
-            // If we're finishing a string, blank it out
-            if (cli->buffer[i] == in_string) {
-                memmove(&cli->buffer[i], &cli->buffer[i + 1],
-                        sizeof(cli->buffer) - i - 1);
+            if (ch == in_string)
                 in_string = '\0';
-            } else {
+        } else if (ch == '\\') {
+            // Skip over whatever is being escaped
+            arg->flags |= EMBEDDED_CLI_ARG_ESCAPED;
+            if (i + 1 < size && buf[i + 1] != '\0')
                 i++;
-            }
-            continue;
+        } else if (ch == '\'' || ch == '"') {
+            arg->flags |= EMBEDDED_CLI_ARG_ESCAPED;
+            in_string = ch;
+        } else if (is_whitespace(ch)) {
+            break;
         }
+    }
+    arg->len = i - arg->offset;
+    *pos = (i < size && buf[i] != '\0') ? i + 1 : i;
+    return true;
+}
 
-        // Skip over whitespace, and replace it with nul terminators so
-        // each argv is nul terminated
-        if (is_whitespace(cli->buffer[i])) {
-            if (in_arg)
-                cli->buffer[i] = '\0';
-            in_arg = false;
-            i++;
+/**
+ * Retrieve the next character of an argument's value from its raw text,
+ * dropping quotes and escape characters
+ * @return false once the raw text is exhausted
+ */
+static bool embedded_cli_arg_char(const char *raw, size_t len, size_t *pos,
+                                  char *in_string, char *ch)
+{
+    while (*pos < len) {
+        char c = raw[(*pos)++];
+        if (*in_string) {
+            if (c == *in_string) {
+                *in_string = '\0';
+                continue;
+            }
+        } else if (c == '\\') {
+            if (*pos >= len)
+                return false;
+            c = raw[(*pos)++];
+        } else if (c == '\'' || c == '"') {
+            *in_string = c;
             continue;
         }
+        *ch = c;
+        return true;
+    }
+    return false;
+}
 
-        if (!in_arg) {
-            if (pos >= EMBEDDED_CLI_MAX_ARGC - 1) {
-                break;
-            }
-            cli->argv[pos] = &cli->buffer[i];
-            pos++;
-            in_arg = true;
-        }
+/**
+ * Write the value of an argument to dst, which may overlap the raw text as
+ * long as it doesn't start after it
+ * @return number of characters written
+ */
+static size_t embedded_cli_unescape(char *dst, const char *raw, size_t len)
+{
+    size_t out = 0;
+    size_t pos = 0;
+    char in_string = '\0';
+    char ch;
+    while (embedded_cli_arg_char(raw, len, &pos, &in_string, &ch))
+        dst[out++] = ch;
+    return out;
+}
 
-        if (cli->buffer[i] == '\\') {
-            // Absorb the escape character
-            memmove(&cli->buffer[i], &cli->buffer[i + 1],
-                    sizeof(cli->buffer) - i - 1);
-            in_escape = true;
-        } else if (cli->buffer[i] == '\'' || cli->buffer[i] == '"') {
-            // If we're starting a new string, absorb the character and
-            // shuffle things back
-            in_string = cli->buffer[i];
-            memmove(&cli->buffer[i], &cli->buffer[i + 1],
-                    sizeof(cli->buffer) - i - 1);
+int embedded_cli_argc(struct embedded_cli *cli, char ***argv)
+{
+    int pos = 0;
+    size_t in = 0;
+    size_t out = 0;
+    struct embedded_cli_arg arg;
+    if (!cli->done)
+        return 0;
+    // The buffer has already been split up, so just count the arguments
+    if (cli->parsed) {
+        while (cli->argv[pos])
+            pos++;
+        *argv = cli->argv;
+        return pos;
+    }
+    cli->parsed = true;
+    // Arguments are unquoted/unescaped by copying them back over the
+    // buffer, which is safe as they can only ever get shorter. Each one is
+    // nul terminated, which will at worst overwrite the whitespace after it
+    while (pos < CLI_MAX_ARGC(cli) - 1 &&
+           embedded_cli_next_arg(cli->buffer, CLI_LINE_SIZE(cli), &in,
+                                 &arg)) {
+        cli->argv[pos] = &cli->buffer[out];
+        pos++;
+        if (arg.flags & EMBEDDED_CLI_ARG_ESCAPED) {
+            out += embedded_cli_unescape(&cli->buffer[out],
+                                         &cli->buffer[arg.offset], arg.len);
         } else {
-            // Just move to the next character
-            i++;
+            CLI_STAT(cli, memmove_bytes, arg.len);
+            memmove(&cli->buffer[out], &cli->buffer[arg.offset], arg.len);
+            out += arg.len;
         }
+        cli->buffer[out++] = '\0';
     }
+
     // Traditionally, there is a NULL entry at argv[argc].
-    if (pos >= EMBEDDED_CLI_MAX_ARGC) {
+    if (pos >= CLI_MAX_ARGC(cli)) {
         pos--;
     }
     cli->argv[pos] = NULL;
@@ -504,7 +2076,132 @@ int embedded_cli_argc(struct embedded_cli *cli, char ***argv)
     return pos;
 }
 
+int embedded_cli_args(const struct embedded_cli *cli,
+                      struct embedded_cli_arg *args, int max_args)
+{
+    int count = 0;
+    size_t pos = 0;
+    if (!cli->done)
+        return 0;
+    while (count < max_args &&
+           embedded_cli_next_arg(cli->buffer, CLI_LINE_SIZE(cli), &pos,
+                                 &args[count]))
+        count++;
+    return count;
+}
+
+bool embedded_cli_arg_equals(const struct embedded_cli *cli,
+                             const struct embedded_cli_arg *arg,
+                             const char *value)
+{
+    const char *raw = &cli->buffer[arg->offset];
+    size_t pos = 0;
+    char in_string = '\0';
+    char ch;
+
+    if (!(arg->flags & EMBEDDED_CLI_ARG_ESCAPED))
+        return strncmp(raw, value, arg->len) == 0 && value[arg->len] == '\0';
+
+    while (embedded_cli_arg_char(raw, arg->len, &pos, &in_string, &ch)) {
+        if (*value++ != ch)
+            return false;
+    }
+    return *value == '\0';
+}
+
+size_t embedded_cli_arg_copy(const struct embedded_cli *cli,
+                             const struct embedded_cli_arg *arg, char *dst,
+                             size_t dst_size)
+{
+    const char *raw = &cli->buffer[arg->offset];
+    size_t out = 0;
+    size_t pos = 0;
+    char in_string = '\0';
+    char ch;
+
+    if (dst_size == 0)
+        return 0;
+    while (out < dst_size - 1 &&
+           embedded_cli_arg_char(raw, arg->len, &pos, &in_string, &ch))
+        dst[out++] = ch;
+    dst[out] = '\0';
+    return out;
+}
+
+#if EMBEDDED_CLI_MAX_COMMANDS
+bool embedded_cli_register_command(struct embedded_cli *cli,
+                                   const struct embedded_cli_command *command)
+{
+    size_t pos = embedded_cli_command_pos(cli->commands, cli->command_count,
+                                          command->name);
+    if (cli->command_count >= EMBEDDED_CLI_MAX_COMMANDS)
+        return false;
+    if (pos < cli->command_count &&
+        strcmp(cli->commands[pos]->name, command->name) == 0)
+        return false;
+    memmove(&cli->commands[pos + 1], &cli->commands[pos],
+            (cli->command_count - pos) * sizeof(cli->commands[0]));
+    cli->commands[pos] = command;
+    cli->command_count++;
+    return true;
+}
+#endif
+
+const struct embedded_cli_command *
+embedded_cli_find_command(const struct embedded_cli *cli, const char *name)
+{
+    const struct embedded_cli_command *command = NULL;
+#if EMBEDDED_CLI_MAX_COMMANDS
+    command =
+        embedded_cli_command_search(cli->commands, cli->command_count, name);
+#else
+    (void)cli;
+#endif
+#if EMBEDDED_CLI_LINKER_COMMANDS
+    if (!command)
+        command = embedded_cli_command_search(embedded_cli_commands_start,
+                                              LINKER_COMMAND_COUNT, name);
+#endif
+#if !EMBEDDED_CLI_MAX_COMMANDS && !EMBEDDED_CLI_LINKER_COMMANDS
+    (void)name;
+#endif
+    return command;
+}
+
+bool embedded_cli_dispatch(struct embedded_cli *cli, int *retval)
+{
+    char **argv;
+    int argc = embedded_cli_argc(cli, &argv);
+    const struct embedded_cli_command *command;
+    int ret;
+
+    if (argc < 1)
+        return false;
+    command = embedded_cli_find_command(cli, argv[0]);
+    if (!command)
+        return false;
+    ret = command->handler(cli, argc, argv);
+    if (retval)
+        *retval = ret;
+    return true;
+}
+
 void embedded_cli_prompt(struct embedded_cli *cli)
 {
+#if EMBEDDED_CLI_TX_BUF_LEN
+    cli->tx_prompted = true;
+#endif
+#if EMBEDDED_CLI_BRACKETED_PASTE
+    cli_puts(cli, PASTE_ENABLE);
+#endif
     cli_puts(cli, cli->prompt);
-}
\ No newline at end of file
+    cli_flush(cli);
+}
+
+#if EMBEDDED_CLI_STATS
+void embedded_cli_get_stats(const struct embedded_cli *cli,
+                            struct embedded_cli_stats *stats)
+{
+    *stats = cli->stats;
+}
+#endif
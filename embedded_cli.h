@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #ifndef EMBEDDED_CLI_MAX_LINE
 /**
@@ -19,6 +20,70 @@
 #define EMBEDDED_CLI_HISTORY_LEN 1000
 #endif
 
+#ifndef EMBEDDED_CLI_HISTORY_ENTRIES
+/**
+ * Maximum number of entries to retain in the history. Each entry has a
+ * small index record, so that entries can be found without scanning the
+ * history data
+ */
+#define EMBEDDED_CLI_HISTORY_ENTRIES 64
+#endif
+
+#ifndef EMBEDDED_CLI_HISTORY_COMPRESS
+/**
+ * Store each history entry as the number of characters it has in common
+ * with the one before it, followed by the rest of it. When commands share
+ * long prefixes, this fits several times as many entries in
+ * EMBEDDED_CLI_HISTORY_LEN, at the cost of an extra line of RAM to decode
+ * entries into.
+ * Define this to 1 to enable history compression
+ */
+#define EMBEDDED_CLI_HISTORY_COMPRESS 0
+#endif
+
+#ifndef EMBEDDED_CLI_HISTORY_RESTART
+/**
+ * With EMBEDDED_CLI_HISTORY_COMPRESS, every this many entries one is stored
+ * in full. This limits the number of entries which need decoding to
+ * retrieve any one of them
+ */
+#define EMBEDDED_CLI_HISTORY_RESTART 8
+#endif
+
+#ifndef EMBEDDED_CLI_HISTORY_DEDUP
+/**
+ * When a line is already in the history, move the existing entry to be the
+ * most recent, rather than storing it again. Each entry has a 16-bit
+ * fingerprint, so that duplicates can be found without comparing against
+ * every entry. This can't be combined with EMBEDDED_CLI_HISTORY_COMPRESS.
+ * Define this to 1 to enable history deduplication
+ */
+#define EMBEDDED_CLI_HISTORY_DEDUP 0
+#endif
+
+#ifndef EMBEDDED_CLI_HISTORY_STORE
+/**
+ * Support keeping a copy of the history in persistent storage, such as
+ * flash or a file (see @ref embedded_cli_history_load).
+ * Define this to 1 to enable persistent history support
+ */
+#define EMBEDDED_CLI_HISTORY_STORE 0
+#endif
+
+#if !EMBEDDED_CLI_HISTORY_LEN
+// There is nothing to store
+#undef EMBEDDED_CLI_HISTORY_COMPRESS
+#define EMBEDDED_CLI_HISTORY_COMPRESS 0
+#undef EMBEDDED_CLI_HISTORY_DEDUP
+#define EMBEDDED_CLI_HISTORY_DEDUP 0
+#undef EMBEDDED_CLI_HISTORY_STORE
+#define EMBEDDED_CLI_HISTORY_STORE 0
+#endif
+
+#if EMBEDDED_CLI_HISTORY_COMPRESS && EMBEDDED_CLI_HISTORY_DEDUP
+#error "History compression and deduplication can't be used together"
+#endif
+
 #ifndef EMBEDDED_CLI_MAX_ARGC
 /**
  * What is the maximum number of arguments we reserve space for
@@ -33,6 +98,88 @@
 #define EMBEDDED_CLI_MAX_PROMPT_LEN 10
 #endif
 
+#ifndef EMBEDDED_CLI_RUNTIME_BUFFERS
+/**
+ * Use line, history and argv storage provided by the caller (see
+ * @ref embedded_cli_init_buffers), so that each CLI instance can be a
+ * different size. EMBEDDED_CLI_MAX_LINE, EMBEDDED_CLI_HISTORY_LEN and
+ * EMBEDDED_CLI_MAX_ARGC are then the largest sizes which can be used.
+ * Define this to 1 to enable caller provided storage
+ */
+#define EMBEDDED_CLI_RUNTIME_BUFFERS 0
+#endif
+
+#ifndef EMBEDDED_CLI_BUILTIN_BUFFERS
+/**
+ * With EMBEDDED_CLI_RUNTIME_BUFFERS, also include full sized storage in
+ * struct embedded_cli, for use by @ref embedded_cli_init.
+ * Define this to 0 to leave it out, so that only
+ * @ref embedded_cli_init_buffers can be used
+ */
+#define EMBEDDED_CLI_BUILTIN_BUFFERS 1
+#endif
+
+#ifndef EMBEDDED_CLI_RX_BUF_LEN
+/**
+ * Number of bytes in the receive buffer used by @ref embedded_cli_isr_push.
+ * One byte of this is always kept free.
+ * Define this to 0 to remove interrupt driven input support
+ */
+#define EMBEDDED_CLI_RX_BUF_LEN 0
+#endif
+
+#ifndef EMBEDDED_CLI_TX_BUF_LEN
+/**
+ * Number of bytes in the transmit buffer drained by
+ * @ref embedded_cli_tx_peek / @ref embedded_cli_tx_ack. One byte of this is
+ * always kept free. This should be large enough to hold a full redraw of
+ * the line (EMBEDDED_CLI_MAX_LINE + EMBEDDED_CLI_MAX_PROMPT_LEN + 16).
+ * Define this to 0 to remove transmit buffer support
+ */
+#define EMBEDDED_CLI_TX_BUF_LEN 0
+#endif
+
+#ifndef EMBEDDED_CLI_BARRIER
+/**
+ * Memory barrier used between the interrupt and main loop sides of the
+ * receive & transmit buffers. This must at least prevent the compiler from
+ * reordering memory accesses across it, and if the two run on different
+ * CPU cores it must also be a hardware memory barrier. GCC compatible and
+ * C11 compilers get a full fence; others must define this themselves if
+ * either buffer is enabled
+ */
+#if defined(__GNUC__)
+#define EMBEDDED_CLI_BARRIER() __sync_synchronize()
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L &&             \
+    !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#define EMBEDDED_CLI_BARRIER() atomic_thread_fence(memory_order_seq_cst)
+#elif EMBEDDED_CLI_RX_BUF_LEN || EMBEDDED_CLI_TX_BUF_LEN
+#error "Define EMBEDDED_CLI_BARRIER() as a memory barrier for this compiler"
+#else
+// Not used without the receive & transmit buffers
+#define EMBEDDED_CLI_BARRIER()
+#endif
+#endif
+
+#ifndef EMBEDDED_CLI_MAX_COMMANDS
+/**
+ * Maximum number of commands which can be registered with
+ * @ref embedded_cli_register_command.
+ * Define this to 0 to remove command registration support
+ */
+#define EMBEDDED_CLI_MAX_COMMANDS 0
+#endif
+
+#ifndef EMBEDDED_CLI_LINKER_COMMANDS
+/**
+ * Support commands defined at compile time with @ref EMBEDDED_CLI_COMMAND.
+ * This requires GCC (or compatible) and the linker script fragment in
+ * embedded_cli_commands.ld
+ */
+#define EMBEDDED_CLI_LINKER_COMMANDS 0
+#endif
+
 #ifndef EMBEDDED_CLI_SERIAL_XLATE
 /**
  * Translate CR -> NL on input and output CR NL on output. This allows
@@ -41,6 +188,353 @@
 #define EMBEDDED_CLI_SERIAL_XLATE 1
 #endif
 
+#ifndef EMBEDDED_CLI_BRACKETED_PASTE
+/**
+ * Ask the terminal to mark pasted text (ESC[?2004h, sent with the prompt),
+ * and insert it literally, with a single screen update.
+ * Define this to 1 to enable bracketed paste support
+ */
+#define EMBEDDED_CLI_BRACKETED_PASTE 0
+#endif
+
+#ifndef EMBEDDED_CLI_BATCH_MODE
+/**
+ * Support a non-interactive mode (see @ref embedded_cli_set_batch), for
+ * scripted input.
+ * Define this to 1 to enable batch mode support
+ */
+#define EMBEDDED_CLI_BATCH_MODE 0
+#endif
+
+#ifndef EMBEDDED_CLI_STATS
+/**
+ * Count the work done by the CLI (see @ref embedded_cli_get_stats), to help
+ * find out what it is costing in the field.
+ * Define this to 1 to enable the counters
+ */
+#define EMBEDDED_CLI_STATS 0
+#endif
+
+#ifndef EMBEDDED_CLI_OUTPUT_BUF_LEN
+/**
+ * Number of bytes of output to stage before passing them to the put_buf
+ * callback (see @ref embedded_cli_set_put_buf).
+ * Define this to 0 to remove block output support
+ */
+#define EMBEDDED_CLI_OUTPUT_BUF_LEN 0
+#endif
+
+#ifndef EMBEDDED_CLI_COMPACT
+/**
+ * Use the smallest integer types which hold the configured limits for the
+ * positions & counts kept in struct embedded_cli, and store its flags as
+ * single bits. This saves RAM (tests/sizes.sh shows how much), at the cost
+ * of a little extra code on CPUs which only do arithmetic in full words.
+ * Define this to 1 to enable the compact layout
+ */
+#define EMBEDDED_CLI_COMPACT 0
+#endif
+
+#if EMBEDDED_CLI_HISTORY_LEN
+/**
+ * Offset of an entry within the history buffer
+ */
+#if EMBEDDED_CLI_HISTORY_LEN <= 0x100
+typedef uint8_t embedded_cli_history_offset_t;
+#elif EMBEDDED_CLI_HISTORY_LEN <= 0x10000
+typedef uint16_t embedded_cli_history_offset_t;
+#else
+typedef uint32_t embedded_cli_history_offset_t;
+#endif
+#endif
+
+/**
+ * Position within the line
+ */
+#if EMBEDDED_CLI_COMPACT && EMBEDDED_CLI_MAX_LINE <= 0x100
+typedef uint8_t embedded_cli_line_index_t;
+#elif EMBEDDED_CLI_COMPACT && EMBEDDED_CLI_MAX_LINE <= 0x10000
+typedef uint16_t embedded_cli_line_index_t;
+#else
+typedef size_t embedded_cli_line_index_t;
+#endif
+
+/**
+ * Parameter of an escape sequence. These are never allowed past 999
+ */
+#if EMBEDDED_CLI_COMPACT
+typedef uint16_t embedded_cli_counter_t;
+#else
+typedef size_t embedded_cli_counter_t;
+#endif
+
+#if EMBEDDED_CLI_HISTORY_LEN
+/**
+ * Slot within the history index
+ */
+#if EMBEDDED_CLI_COMPACT && EMBEDDED_CLI_HISTORY_ENTRIES <= 0x100
+typedef uint8_t embedded_cli_history_slot_t;
+#elif EMBEDDED_CLI_COMPACT && EMBEDDED_CLI_HISTORY_ENTRIES <= 0x10000
+typedef uint16_t embedded_cli_history_slot_t;
+#else
+typedef size_t embedded_cli_history_slot_t;
+#endif
+
+/**
+ * Number of entries in, or back through, the history
+ */
+#if EMBEDDED_CLI_COMPACT && EMBEDDED_CLI_HISTORY_ENTRIES <= 0x7f
+typedef int8_t embedded_cli_history_pos_t;
+#elif EMBEDDED_CLI_COMPACT && EMBEDDED_CLI_HISTORY_ENTRIES <= 0x7fff
+typedef int16_t embedded_cli_history_pos_t;
+#else
+typedef int embedded_cli_history_pos_t;
+#endif
+#endif
+
+/**
+ * Width of each flag in struct embedded_cli
+ */
+#if EMBEDDED_CLI_COMPACT
+#define EMBEDDED_CLI_FLAG : 1
+#else
+#define EMBEDDED_CLI_FLAG
+#endif
+
+#if EMBEDDED_CLI_RX_BUF_LEN
+/**
+ * Position within the receive buffer. This is kept small so that it can be
+ * read & written atomically
+ */
+#if EMBEDDED_CLI_RX_BUF_LEN <= 0x100
+typedef uint8_t embedded_cli_rx_index_t;
+#else
+typedef uint16_t embedded_cli_rx_index_t;
+#endif
+#endif
+
+#if EMBEDDED_CLI_TX_BUF_LEN
+/**
+ * Position within the transmit buffer. This is kept small so that it can be
+ * read & written atomically
+ */
+#if EMBEDDED_CLI_TX_BUF_LEN <= 0x100
+typedef uint8_t embedded_cli_tx_index_t;
+#else
+typedef uint16_t embedded_cli_tx_index_t;
+#endif
+
+/**
+ * What to do when output doesn't fit in the transmit buffer
+ */
+enum embedded_cli_tx_policy {
+    /**
+     * Transmit buffer is not used, output goes to put_char/put_buf
+     */
+    EMBEDDED_CLI_TX_OFF,
+    /**
+     * Discard the output, and redraw the whole line once there is room.
+     * Input processing never waits for the transmitter
+     */
+    EMBEDDED_CLI_TX_DROP,
+    /**
+     * Wait for the transmitter to make room, calling tx_wait (if set) while
+     * waiting
+     */
+    EMBEDDED_CLI_TX_BLOCK,
+};
+#endif
+
+/**
+ * Flag for @ref embedded_cli_arg: the argument contains quotes or escape
+ * characters, so its raw text differs from its value
+ */
+#define EMBEDDED_CLI_ARG_ESCAPED 0x01
+
+/**
+ * Location of a single argument within the command line, as returned by
+ * @ref embedded_cli_args
+ */
+struct embedded_cli_arg {
+    /**
+     * Offset of the raw argument text within the line
+     */
+    size_t offset;
+
+    /**
+     * Number of bytes of raw argument text (including any quotes/escapes)
+     */
+    size_t len;
+
+    /**
+     * EMBEDDED_CLI_ARG_xxx flags
+     */
+    unsigned int flags;
+};
+
+#if EMBEDDED_CLI_STATS
+/**
+ * Counters of the work done by the CLI, as returned by
+ * @ref embedded_cli_get_stats. These all wrap around on overflow
+ */
+struct embedded_cli_stats {
+    /**
+     * Number of input characters processed
+     */
+    uint32_t chars;
+
+    /**
+     * Number of bytes of output emitted, including any CR added by
+     * EMBEDDED_CLI_SERIAL_XLATE
+     */
+    uint32_t output_bytes;
+
+    /**
+     * Number of escape sequences parsed
+     */
+    uint32_t escapes;
+
+    /**
+     * Number of history entries discarded to make room for new ones
+     */
+    uint32_t history_evictions;
+
+    /**
+     * Number of history entries compared against a search term
+     */
+    uint32_t search_compares;
+
+    /**
+     * Number of bytes of the line moved around by editing & parsing
+     */
+    uint32_t memmove_bytes;
+
+    /**
+     * Number of complete lines accepted
+     */
+    uint32_t lines;
+};
+#endif
+
+#if EMBEDDED_CLI_HISTORY_STORE
+/**
+ * Persistent storage for the history, used by @ref embedded_cli_history_load
+ * and @ref embedded_cli_history_save.
+ * The history is stored as a small header, followed by one record per
+ * entry, oldest first. Each record has a CRC, so a partially written record
+ * (eg: due to a power failure) is discarded when loading. New entries are
+ * appended after the previous ones, and the storage is only rewritten from
+ * the start once it is full. Nothing is written after the last record;
+ * the end of the history is found by reading erased (0xff) space, or by
+ * running off the end of the storage. This means that erased flash can be
+ * written to without erasing it again, until a write at offset 0 starts
+ * the history afresh.
+ */
+struct embedded_cli_history_store {
+    /**
+     * Reads data from the storage
+     * @return number of bytes read, which may be less than len at the end of
+     * the storage
+     */
+    size_t (*read)(void *data, size_t offset, void *buf, size_t len);
+
+    /**
+     * Writes data to the storage. Writes are always sequential, from
+     * offset 0 upwards, and never overlap, so each byte is written at most
+     * once after a write at offset 0. That write replaces the whole
+     * history, so flash must be erased (or a file truncated) at this point;
+     * space which hasn't been written must read back as 0xff, or not at all
+     * @return false if the data could not be written
+     */
+    bool (*write)(void *data, size_t offset, const void *buf, size_t len);
+
+    /**
+     * Data to provide to the read/write callbacks
+     */
+    void *data;
+
+    /**
+     * Number of bytes available in the storage
+     */
+    size_t size;
+};
+#endif
+
+#if EMBEDDED_CLI_RUNTIME_BUFFERS
+/**
+ * Storage for a CLI instance, as passed to @ref embedded_cli_init_buffers.
+ * The sizes are limited to EMBEDDED_CLI_MAX_LINE, EMBEDDED_CLI_HISTORY_LEN
+ * and EMBEDDED_CLI_MAX_ARGC
+ */
+struct embedded_cli_buffers {
+    /**
+     * Buffer for the line being edited. The longest line accepted is
+     * line_size - 1 characters, so line_size must be at least 2
+     */
+    char *line;
+    size_t line_size;
+
+    /**
+     * Buffer for the history. This may be NULL (with a history_size of 0)
+     * for an instance without history
+     */
+    char *history;
+    size_t history_size;
+
+    /**
+     * Space for the argument pointers returned by @ref embedded_cli_argc.
+     * At most max_argc - 1 arguments are returned, and there must be room
+     * for the terminating NULL, so max_argc must be at least 1
+     */
+    char **argv;
+    int max_argc;
+};
+#endif
+
+struct embedded_cli;
+
+/**
+ * Description of a command which can be run by @ref embedded_cli_dispatch
+ */
+struct embedded_cli_command {
+    /**
+     * Name of the command, as matched against argv[0]
+     */
+    const char *name;
+
+    /**
+     * Function to run the command. argv[0] is the command name
+     * @return command specific result, passed back from
+     * @ref embedded_cli_dispatch
+     */
+    int (*handler)(struct embedded_cli *cli, int argc, char **argv);
+
+    /**
+     * Short description of the command
+     */
+    const char *help;
+};
+
+#if EMBEDDED_CLI_LINKER_COMMANDS
+/**
+ * Defines a command at compile time, which will be available to
+ * @ref embedded_cli_dispatch for all CLI instances. The command is stored
+ * entirely in read only memory. The linker script fragment in
+ * embedded_cli_commands.ld sorts these by name, so they can be searched
+ * without any run time setup.
+ * @param name Name of the command. This must be a valid C identifier
+ * @param fn Handler function (see @ref embedded_cli_command)
+ * @param help Short description of the command
+ */
+#define EMBEDDED_CLI_COMMAND(name, fn, help)                                  \
+    static const struct embedded_cli_command embedded_cli_command_##name = {  \
+        #name, fn, help};                                                     \
+    __attribute__((section(".embedded_cli_commands." #name),                  \
+                   used)) static const struct embedded_cli_command            \
+        *const embedded_cli_command_ptr_##name =                              \
+            &embedded_cli_command_##name
+#endif
+
 /**
  * This is the structure which defines the current state of the CLI
  * NOTE: Although this structure is exposed here, it is not recommended
@@ -53,39 +547,77 @@ struct embedded_cli {
      * Internal buffer. This should not be accessed directly, use the
      * access functions below
      */
+#if EMBEDDED_CLI_RUNTIME_BUFFERS
+    char *buffer;
+
+    /**
+     * Number of bytes in buffer
+     */
+    size_t line_size;
+#else
     char buffer[EMBEDDED_CLI_MAX_LINE];
+#endif
 
 #if EMBEDDED_CLI_HISTORY_LEN
     /**
-     * List of history entries
+     * Circular list of nul terminated history entries. Entries are never
+     * split across the end of the buffer. With
+     * EMBEDDED_CLI_HISTORY_COMPRESS, each entry starts with a byte giving
+     * the number of characters it shares with the previous entry, which is
+     * 0 for the oldest entry and at the start of the buffer
+     */
+#if EMBEDDED_CLI_RUNTIME_BUFFERS
+    char *history;
+
+    /**
+     * Number of bytes in history
      */
+    size_t history_size;
+#else
     char history[EMBEDDED_CLI_HISTORY_LEN];
+#endif
 
+#if EMBEDDED_CLI_HISTORY_COMPRESS
     /**
-     * Are we searching through the history?
+     * Decoded history entry, as returned by embedded_cli_get_history
+     */
+    char history_line[EMBEDDED_CLI_MAX_LINE];
+#endif
+
+    /**
+     * Circular list of the offsets of each entry in history, oldest first.
+     * Unless EMBEDDED_CLI_HISTORY_DEDUP is enabled, this is also the order
+     * in which they are stored
      */
-    bool searching;
+    embedded_cli_history_offset_t
+        history_index[EMBEDDED_CLI_HISTORY_ENTRIES];
 
+#if EMBEDDED_CLI_HISTORY_DEDUP
     /**
-     * How far back in the history are we?
+     * Fingerprint of each entry in history, matching history_index
      */
-    int history_pos;
+    uint16_t history_hash[EMBEDDED_CLI_HISTORY_ENTRIES];
 #endif
 
+#if EMBEDDED_CLI_HISTORY_STORE
     /**
-     * Number of characters in buffer at the moment
+     * Persistent storage new history entries are appended to
      */
-    size_t len;
+    const struct embedded_cli_history_store *store;
 
     /**
-     * Position of the cursor
+     * Number of bytes of history in store, where the next entry is written
      */
-    size_t cursor;
+    size_t store_len;
 
     /**
-     * Have we just parsed a full line?
+     * Incremented each time store is rewritten from the start. This is
+     * included in the CRC of each record, so that stale records left over
+     * from a previous write aren't mistaken for current ones
      */
-    bool done;
+    uint16_t store_generation;
+#endif
+#endif
 
     /**
      * Callback function to output a single character to the user
@@ -95,29 +627,360 @@ struct embedded_cli {
     void (*put_char)(void *data, char ch, bool is_last);
 
     /**
-     * Data to provide to the put_char callback
+     * Data to provide to the put_char/put_buf callbacks
      */
     void *cb_data;
 
-    bool have_escape;
-    bool have_csi;
+#if EMBEDDED_CLI_OUTPUT_BUF_LEN
+    /**
+     * Callback function to output a block of characters to the user.
+     * If set, this is used in preference to put_char
+     */
+    void (*put_buf)(void *data, const char *buf, size_t len);
 
     /**
-     * counter of the value for the CSI code
+     * Output staged for put_buf
      */
-    size_t counter;
+    char out_buf[EMBEDDED_CLI_OUTPUT_BUF_LEN];
 
+    /**
+     * Number of bytes in out_buf
+     */
+    size_t out_len;
+#endif
+
+#if EMBEDDED_CLI_RUNTIME_BUFFERS
+    char **argv;
+
+    /**
+     * Number of entries in argv
+     */
+    int max_argc;
+#else
     char *argv[EMBEDDED_CLI_MAX_ARGC];
+#endif
+
+#if EMBEDDED_CLI_MAX_COMMANDS
+    /**
+     * Registered commands, sorted by name
+     */
+    const struct embedded_cli_command *commands[EMBEDDED_CLI_MAX_COMMANDS];
+
+    /**
+     * Number of entries in commands
+     */
+    size_t command_count;
+#endif
 
     char prompt[EMBEDDED_CLI_MAX_PROMPT_LEN];
+
+#if EMBEDDED_CLI_STATS
+    /**
+     * Counters returned by embedded_cli_get_stats
+     */
+    struct embedded_cli_stats stats;
+#endif
+
+#if EMBEDDED_CLI_RX_BUF_LEN
+    /**
+     * Characters received by embedded_cli_isr_push, waiting for
+     * embedded_cli_poll
+     */
+    char rx_buf[EMBEDDED_CLI_RX_BUF_LEN];
+
+    /**
+     * Position in rx_buf of the next character to be received. This is
+     * only written by embedded_cli_isr_push
+     */
+    volatile embedded_cli_rx_index_t rx_head;
+
+    /**
+     * Position in rx_buf of the next character to be processed. This is
+     * only written by embedded_cli_poll
+     */
+    volatile embedded_cli_rx_index_t rx_tail;
+#endif
+
+#if EMBEDDED_CLI_TX_BUF_LEN
+    /**
+     * Callback used by EMBEDDED_CLI_TX_BLOCK while the buffer is full
+     */
+    void (*tx_wait)(void *data);
+
+    /**
+     * Output waiting to be collected by embedded_cli_tx_peek
+     */
+    char tx_buf[EMBEDDED_CLI_TX_BUF_LEN];
+
+    /**
+     * Position in tx_buf after the last character which is ready to be
+     * sent. This is only written by the line editor, once a complete update
+     * has been queued
+     */
+    volatile embedded_cli_tx_index_t tx_head;
+
+    /**
+     * Position in tx_buf of the next character to be sent. This is only
+     * written by embedded_cli_tx_ack
+     */
+    volatile embedded_cli_tx_index_t tx_tail;
+
+    /**
+     * Position in tx_buf of the next character to be queued. Characters
+     * between tx_head and here are not yet visible to embedded_cli_tx_peek
+     */
+    embedded_cli_tx_index_t tx_fill;
+
+    /**
+     * Current enum embedded_cli_tx_policy
+     */
+    uint8_t tx_policy;
+#endif
+
+    /*
+     * The positions & counts below are kept together, followed by the
+     * flags, so that with EMBEDDED_CLI_COMPACT there is little padding
+     * between them and the flags share bytes
+     */
+
+    /**
+     * counter of the value for the CSI code
+     */
+    embedded_cli_counter_t counter;
+
+#if EMBEDDED_CLI_HISTORY_LEN
+    /**
+     * Offset in history at which the next entry will be stored
+     */
+    embedded_cli_history_offset_t history_head;
+
+    /**
+     * Slot in history_index of the oldest entry
+     */
+    embedded_cli_history_slot_t history_first;
+
+    /**
+     * Number of entries in history
+     */
+    embedded_cli_history_pos_t history_count;
+
+    /**
+     * One more than the history entry which matches the current search, or
+     * 0 for none, so that a zeroed structure has no match
+     */
+    embedded_cli_history_pos_t search_pos;
+
+    /**
+     * How far back in the history are we? 0 is the line being edited, 1 is
+     * the most recent entry, and so on
+     */
+    embedded_cli_history_pos_t history_pos;
+#endif
+
+    /**
+     * Number of characters in buffer at the moment
+     */
+    embedded_cli_line_index_t len;
+
+    /**
+     * Position of the cursor
+     */
+    embedded_cli_line_index_t cursor;
+
+    /**
+     * Position of the cursor on the terminal, relative to the start of the
+     * buffer
+     */
+    embedded_cli_line_index_t screen_cursor;
+
+    /**
+     * Number of characters of the line currently shown on the terminal
+     */
+    embedded_cli_line_index_t screen_len;
+
+    /**
+     * First position in the buffer which may not match the screen, when
+     * dirty is set
+     */
+    embedded_cli_line_index_t dirty_from;
+
+    /**
+     * Progress through the escape sequence being received
+     */
+    uint8_t escape;
+
+    /**
+     * Second parameter of the escape sequence, giving the modifier keys
+     * held down
+     */
+    uint8_t modifier;
+
+#if EMBEDDED_CLI_HISTORY_LEN
+    /**
+     * Are we searching through the history?
+     */
+    bool searching EMBEDDED_CLI_FLAG;
+#endif
+
+    /**
+     * Are screen updates being held back, because more input is on the way?
+     */
+    bool defer_output EMBEDDED_CLI_FLAG;
+
+    /**
+     * Has the line changed since the screen was last brought up to date?
+     */
+    bool dirty EMBEDDED_CLI_FLAG;
+
+    /**
+     * Have we just parsed a full line?
+     */
+    bool done EMBEDDED_CLI_FLAG;
+
+#if EMBEDDED_CLI_BRACKETED_PASTE
+    /**
+     * Are we between the start & end markers of pasted text?
+     */
+    bool pasting EMBEDDED_CLI_FLAG;
+#endif
+
+#if EMBEDDED_CLI_BATCH_MODE
+    /**
+     * Is input being taken as plain lines, with no echo or editing?
+     */
+    bool batch EMBEDDED_CLI_FLAG;
+
+#if EMBEDDED_CLI_SERIAL_XLATE
+    /**
+     * Did the last batch line end with a carriage return? If so, a newline
+     * straight after it is part of the same line ending
+     */
+    bool batch_cr EMBEDDED_CLI_FLAG;
+#endif
+#endif
+
+    /**
+     * Has the buffer been split up into argv?
+     */
+    bool parsed EMBEDDED_CLI_FLAG;
+
+#if EMBEDDED_CLI_MAX_COMMANDS || EMBEDDED_CLI_LINKER_COMMANDS
+    /**
+     * Was the previous key tab?
+     */
+    bool tabbed EMBEDDED_CLI_FLAG;
+#endif
+
+#if EMBEDDED_CLI_TX_BUF_LEN
+    /**
+     * Has output been discarded, so the line needs redrawing?
+     */
+    bool tx_dropped EMBEDDED_CLI_FLAG;
+
+    /**
+     * Has embedded_cli_prompt been called since the last line was
+     * completed? Used to work out what a redraw should show
+     */
+    bool tx_prompted EMBEDDED_CLI_FLAG;
+#endif
+
+#if EMBEDDED_CLI_RUNTIME_BUFFERS && EMBEDDED_CLI_BUILTIN_BUFFERS
+    /**
+     * Storage used by embedded_cli_init
+     */
+    char builtin_line[EMBEDDED_CLI_MAX_LINE];
+#if EMBEDDED_CLI_HISTORY_LEN
+    char builtin_history[EMBEDDED_CLI_HISTORY_LEN];
+#endif
+    char *builtin_argv[EMBEDDED_CLI_MAX_ARGC];
+#endif
 };
 
+#if !EMBEDDED_CLI_RUNTIME_BUFFERS || EMBEDDED_CLI_BUILTIN_BUFFERS
 /**
  * Start up the Embedded CLI subsystem. This should only be called once.
  */
 void embedded_cli_init(struct embedded_cli *, const char *prompt,
                        void (*put_char)(void *data, char ch, bool is_last),
                        void *cb_data);
+#endif
+
+/**
+ * Sets the callback used to output a single character, and the data passed
+ * to it (and to put_buf). Together with @ref embedded_cli_set_prompt, this
+ * is all a zeroed instance needs. Without EMBEDDED_CLI_RUNTIME_BUFFERS, a
+ * structure which is all zero, such as one in .bss, is already in the same
+ * state as after embedded_cli_init(cli, NULL, NULL, NULL), so a static
+ * instance can be brought up without the init call clearing it again:
+ *
+ *     static struct embedded_cli cli;
+ *     ...
+ *     embedded_cli_set_put_char(&cli, uart_putchar, NULL);
+ *     embedded_cli_set_prompt(&cli, "> ");
+ */
+void embedded_cli_set_put_char(struct embedded_cli *cli,
+                               void (*put_char)(void *data, char ch,
+                                                bool is_last),
+                               void *cb_data);
+
+/**
+ * Sets the prompt shown by @ref embedded_cli_prompt and when the line is
+ * redrawn. It is truncated to EMBEDDED_CLI_MAX_PROMPT_LEN - 1 characters
+ * @param prompt New prompt, or NULL for none
+ */
+void embedded_cli_set_prompt(struct embedded_cli *cli, const char *prompt);
+
+#if !EMBEDDED_CLI_RUNTIME_BUFFERS
+/**
+ * Initialiser for a statically allocated CLI, giving the same state as
+ * @ref embedded_cli_init with no call needed:
+ *
+ *     static struct embedded_cli cli =
+ *         EMBEDDED_CLI_STATIC_INIT("> ", uart_putchar, NULL);
+ *
+ * Note that this makes the whole structure initialised data, so its image
+ * takes up flash and is copied into RAM at reset, which costs about as much
+ * as embedded_cli_init. Leaving the structure in .bss and using
+ * @ref embedded_cli_set_put_char and @ref embedded_cli_set_prompt avoids
+ * both.
+ * @param prompt_str String literal, shorter than EMBEDDED_CLI_MAX_PROMPT_LEN
+ * @param put_char_fn Callback function to output a single character
+ * @param data Data to provide to the callbacks
+ */
+#define EMBEDDED_CLI_STATIC_INIT(prompt_str, put_char_fn, data)               \
+    {                                                                         \
+        .put_char = (put_char_fn), .cb_data = (data), .prompt = prompt_str    \
+    }
+#endif
+
+#if EMBEDDED_CLI_RUNTIME_BUFFERS
+/**
+ * Start up a CLI instance using the given storage, instead of storage
+ * within struct embedded_cli. The buffers structure is not retained, but the
+ * storage it points to must remain valid while the CLI is in use.
+ * @return false if the buffers are smaller than the minimums given in
+ * struct embedded_cli_buffers, in which case cli is left untouched
+ */
+bool embedded_cli_init_buffers(struct embedded_cli *cli, const char *prompt,
+                               void (*put_char)(void *data, char ch,
+                                                bool is_last),
+                               void *cb_data,
+                               const struct embedded_cli_buffers *buffers);
+#endif
+
+#if EMBEDDED_CLI_OUTPUT_BUF_LEN
+/**
+ * Sets a callback to output blocks of characters. Output is staged
+ * internally, and passed to this callback once per call to
+ * @ref embedded_cli_insert_char, @ref embedded_cli_insert_buffer and
+ * @ref embedded_cli_prompt (or whenever EMBEDDED_CLI_OUTPUT_BUF_LEN bytes
+ * have accumulated). The put_char callback is not used while this is set.
+ * @param put_buf Callback function, or NULL to revert to put_char
+ */
+void embedded_cli_set_put_buf(struct embedded_cli *cli,
+                              void (*put_buf)(void *data, const char *buf,
+                                              size_t len));
+#endif
 
 /**
  * Adds a new character into the buffer. Returns true if
@@ -126,6 +989,102 @@ void embedded_cli_init(struct embedded_cli *, const char *prompt,
  */
 bool embedded_cli_insert_char(struct embedded_cli *cli, char ch);
 
+/**
+ * Adds a block of characters into the buffer, such as the contents of a
+ * receive FIFO. Runs of plain characters are inserted & echoed in a single
+ * operation, so this is considerably faster than calling
+ * @ref embedded_cli_insert_char for each character.
+ * Processing stops as soon as a full line has been received, so that it can
+ * be processed. The remaining characters should be passed in again once
+ * that is done.
+ * Note: This function should not be called from an interrupt handler.
+ * @return number of bytes consumed from buf. If this is less than len, or
+ * @ref embedded_cli_get_line returns non-NULL, a line is ready
+ */
+size_t embedded_cli_insert_buffer(struct embedded_cli *cli, const char *buf,
+                                  size_t len);
+
+#if EMBEDDED_CLI_RX_BUF_LEN
+/**
+ * Queues a received character, to be processed by @ref embedded_cli_poll.
+ * This is safe to call from an interrupt (or signal) handler, provided
+ * there is only ever one caller at a time. It does not output anything.
+ * @return false if the receive buffer is full, and the character was
+ * dropped
+ */
+bool embedded_cli_isr_push(struct embedded_cli *cli, char ch);
+
+/**
+ * Processes characters queued by @ref embedded_cli_isr_push. Processing
+ * stops as soon as a full line has been received. Any remaining characters
+ * are kept until the next call, so this should be called again once the
+ * line has been handled.
+ * Note: This function should not be called from an interrupt handler.
+ * @return true if the buffer should now be processed
+ */
+bool embedded_cli_poll(struct embedded_cli *cli);
+#endif
+
+#if EMBEDDED_CLI_TX_BUF_LEN
+/**
+ * Sends all further output through the transmit buffer, instead of the
+ * put_char/put_buf callbacks. The application then collects it with
+ * @ref embedded_cli_tx_peek, and releases it with @ref embedded_cli_tx_ack
+ * once it has been sent (for example, from a DMA completion interrupt).
+ * @param policy What to do when the transmit buffer is full. Use
+ * EMBEDDED_CLI_TX_OFF to go back to the callbacks
+ * @param tx_wait For EMBEDDED_CLI_TX_BLOCK, called with cb_data while
+ * waiting for room. This should start or continue the transfer. If it is
+ * NULL, then the transfer must be progressing from an interrupt
+ */
+void embedded_cli_set_tx_policy(struct embedded_cli *cli,
+                                enum embedded_cli_tx_policy policy,
+                                void (*tx_wait)(void *data));
+
+/**
+ * Finds the next block of queued output. This is always contiguous in
+ * memory, so can be handed directly to a DMA controller. Once the buffer
+ * wraps around, the remainder is returned by the following call.
+ * This is safe to call from an interrupt handler.
+ * @param data Set to point at the first byte to send
+ * @return Number of bytes to send, or 0 if there is nothing queued
+ */
+size_t embedded_cli_tx_peek(struct embedded_cli *cli, const char **data);
+
+/**
+ * Releases output which has been sent, making room for more.
+ * This is safe to call from an interrupt handler, provided there is only
+ * ever one caller at a time.
+ * @param len Number of bytes sent. This must not be more than the last
+ * value returned by @ref embedded_cli_tx_peek
+ */
+void embedded_cli_tx_ack(struct embedded_cli *cli, size_t len);
+#endif
+
+#if EMBEDDED_CLI_BATCH_MODE
+/**
+ * Switches between interactive editing, and batch mode. In batch mode,
+ * input is collected up to each newline with no echo, no escape sequence
+ * handling and no history, which is much faster for scripted input over a
+ * pipe. A trailing carriage return is removed from each line, and with
+ * EMBEDDED_CLI_SERIAL_XLATE a carriage return on its own also ends a line.
+ * Switching either way abandons any paste in progress, and draws any screen
+ * update which was being held back.
+ * This can be called from a command handler, for example to switch back
+ * to interactive mode at the end of a script.
+ */
+void embedded_cli_set_batch(struct embedded_cli *cli, bool batch);
+#endif
+
+/**
+ * Tells the editor whether more input is known to be waiting (for example,
+ * a receive FIFO which hasn't been emptied yet). While this is set, screen
+ * updates are held back and merged, and the terminal is brought up to date
+ * in one go once it is cleared again. @ref embedded_cli_insert_buffer and
+ * @ref embedded_cli_poll already do this for the input they are given.
+ */
+void embedded_cli_set_input_pending(struct embedded_cli *cli, bool pending);
+
 /**
  * Returns the nul terminated internal buffer. This will
  * return NULL if the buffer is not yet complete
@@ -134,10 +1093,71 @@ const char *embedded_cli_get_line(const struct embedded_cli *cli);
 
 /**
  * Parses the internal buffer and returns it as an argc/argc combo
+ * This modifies the internal buffer, however it may be called multiple times
+ * for the same line
  * @return number of values in argv (maximum of EMBEDDED_CLI_MAX_ARGC - 1)
  */
 int embedded_cli_argc(struct embedded_cli *cli, char ***argv);
 
+/**
+ * Splits the internal buffer into arguments, without modifying it. Unlike
+ * @ref embedded_cli_argc, the line returned by @ref embedded_cli_get_line is
+ * left intact. The results are not valid after @ref embedded_cli_argc has
+ * been called on the same line.
+ * @param args Array to fill in with the location of each argument
+ * @param max_args Number of entries available in args
+ * @return number of arguments filled in
+ */
+int embedded_cli_args(const struct embedded_cli *cli,
+                      struct embedded_cli_arg *args, int max_args);
+
+/**
+ * Compares the value of an argument (ie: with quotes/escapes removed) from
+ * @ref embedded_cli_args against a string, without copying it
+ * @return true if they are identical
+ */
+bool embedded_cli_arg_equals(const struct embedded_cli *cli,
+                             const struct embedded_cli_arg *arg,
+                             const char *value);
+
+/**
+ * Copies the value of an argument (ie: with quotes/escapes removed) from
+ * @ref embedded_cli_args into dst, truncating it if required. dst will
+ * always be nul terminated
+ * @return number of characters copied, not including the nul terminator
+ */
+size_t embedded_cli_arg_copy(const struct embedded_cli *cli,
+                             const struct embedded_cli_arg *arg, char *dst,
+                             size_t dst_size);
+
+#if EMBEDDED_CLI_MAX_COMMANDS
+/**
+ * Adds a command to be run by @ref embedded_cli_dispatch. The command
+ * structure is not copied, so it must remain valid while the CLI is in use.
+ * @return false if the command table is full, or a command with the same
+ * name is already registered
+ */
+bool embedded_cli_register_command(struct embedded_cli *cli,
+                                   const struct embedded_cli_command *command);
+#endif
+
+/**
+ * Find the command with the given name. Commands registered with
+ * @ref embedded_cli_register_command take precedence over those defined with
+ * @ref EMBEDDED_CLI_COMMAND
+ * @return NULL if no such command exists
+ */
+const struct embedded_cli_command *
+embedded_cli_find_command(const struct embedded_cli *cli, const char *name);
+
+/**
+ * Parses the internal buffer with @ref embedded_cli_argc, and runs the
+ * command named by the first argument
+ * @param retval If non-NULL, filled in with the result of the command
+ * @return false if the line is empty, or no such command exists
+ */
+bool embedded_cli_dispatch(struct embedded_cli *cli, int *retval);
+
 /**
  * Outputs the CLI prompt
  * This should be called after @ref embedded_cli_argc or @ref
@@ -154,4 +1174,37 @@ void embedded_cli_prompt(struct embedded_cli *cli);
 const char *embedded_cli_get_history(struct embedded_cli *cli,
                                      int history_pos);
 
+#if EMBEDDED_CLI_HISTORY_STORE
+/**
+ * Loads history entries from persistent storage, and appends all new
+ * entries to it from then on. This should be called straight after
+ * @ref embedded_cli_init. If the storage doesn't hold a valid history, or
+ * the end of it has been damaged, it is rewritten from the start with
+ * whatever could be loaded. The store structure is not copied, so it must
+ * remain valid while the CLI is in use.
+ * @return false if no valid history was found
+ */
+bool embedded_cli_history_load(struct embedded_cli *cli,
+                               const struct embedded_cli_history_store *store);
+
+/**
+ * Writes the whole of the history to persistent storage, starting from
+ * offset 0, and appends all new entries to it from then on. If there isn't
+ * room for all of the history, the oldest entries are left out. The store
+ * structure is not copied, so it must remain valid while the CLI is in use.
+ * @return false if the storage could not be written
+ */
+bool embedded_cli_history_save(struct embedded_cli *cli,
+                               const struct embedded_cli_history_store *store);
+#endif
+
+#if EMBEDDED_CLI_STATS
+/**
+ * Takes a snapshot of the counters of work done since
+ * @ref embedded_cli_init
+ */
+void embedded_cli_get_stats(const struct embedded_cli *cli,
+                            struct embedded_cli_stats *stats);
+#endif
+
 #endif
\ No newline at end of file
@@ -2,6 +2,9 @@
  * Example of using EmbeddedCLI in a posix tty environment.
  * This is useful as a local test for new functionality
  */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -15,13 +18,20 @@
 
 static struct embedded_cli cli;
 
+/**
+ * Set by the SIGINT handler, until the main loop has dealt with it
+ */
+static volatile sig_atomic_t interrupted;
+
 /**
  * This function retrieves exactly one character from stdin,
- * in character-by-character mode (as opposed to reading a full line)
+ * in character-by-character mode (as opposed to reading a full line).
+ * Returns -1 if SIGINT arrived first
  */
-static char getch(void)
+static int getch(void)
 {
     char buf = 0;
+    ssize_t n = 0;
     struct termios old = {0};
     if (tcgetattr(0, &old) < 0)
         perror("tcsetattr()");
@@ -43,18 +53,27 @@ static char getch(void)
     if (tcsetattr(0, TCSANOW, &raw) < 0)
         perror("tcsetattr ICANON");
 
-    if (read(0, &buf, 1) < 0)
+    // Ctrl-C can't raise SIGINT in raw mode, so one which arrived before
+    // now has to be dealt with before waiting for a key
+    if (!interrupted)
+        n = read(0, &buf, 1);
+    if (n < 0 && errno != EINTR)
         perror("read()");
 
     if (tcsetattr(0, TCSADRAIN, &old) < 0)
         perror("tcsetattr ~ICANON");
-    return (buf);
+    return n < 0 || interrupted ? -1 : (unsigned char)buf;
 }
 
 static void intHandler(int dummy)
 {
     (void)dummy;
-    embedded_cli_insert_char(&cli, '\x03');
+#if EMBEDDED_CLI_RX_BUF_LEN
+    // This is the only producer for the receive ring, in the same way a
+    // UART interrupt would be
+    embedded_cli_isr_push(&cli, '\x03');
+#endif
+    interrupted = 1;
 }
 
 /**
@@ -69,6 +88,93 @@ static void posix_putch(void *data, char ch, bool is_last)
         fflush(fp);
 }
 
+#if EMBEDDED_CLI_OUTPUT_BUF_LEN
+/**
+ * This function outputs a block of characters to stdout, to be used as the
+ * block output callback from embedded cli
+ */
+static void posix_putbuf(void *data, const char *buf, size_t len)
+{
+    FILE *fp = data;
+    fwrite(buf, 1, len, fp);
+    fflush(fp);
+}
+#endif
+
+#if EMBEDDED_CLI_TX_BUF_LEN
+/**
+ * This function writes out everything queued in the transmit buffer, in
+ * the way a DMA driven UART would
+ */
+static void posix_tx_drain(void *data)
+{
+    FILE *fp = data;
+    const char *buf;
+    size_t len;
+    while ((len = embedded_cli_tx_peek(&cli, &buf)) > 0) {
+        fwrite(buf, 1, len, fp);
+        embedded_cli_tx_ack(&cli, len);
+    }
+    fflush(fp);
+}
+#endif
+
+#if EMBEDDED_CLI_HISTORY_STORE
+/**
+ * Keep the history in a file, so that it survives between runs
+ */
+#define HISTORY_FILE ".posix_demo_history"
+
+static int history_fd = -1;
+
+static size_t posix_history_read(void *data, size_t offset, void *buf,
+                                 size_t len)
+{
+    ssize_t n = pread(*(int *)data, buf, len, (off_t)offset);
+    return n > 0 ? (size_t)n : 0;
+}
+
+static bool posix_history_write(void *data, size_t offset, const void *buf,
+                                size_t len)
+{
+    int fd = *(int *)data;
+    // Starting again, so throw away the old contents
+    if (offset == 0 && ftruncate(fd, 0) < 0)
+        return false;
+    return pwrite(fd, buf, len, (off_t)offset) == (ssize_t)len;
+}
+
+static const struct embedded_cli_history_store history_store = {
+    posix_history_read, posix_history_write, &history_fd, 4096};
+#endif
+
+#if EMBEDDED_CLI_MAX_COMMANDS
+static bool quit;
+
+static int cmd_quit(struct embedded_cli *cli, int argc, char **argv)
+{
+    (void)cli;
+    (void)argc;
+    (void)argv;
+    quit = true;
+    return 0;
+}
+
+static int cmd_echo(struct embedded_cli *cli, int argc, char **argv)
+{
+    (void)cli;
+    for (int i = 1; i < argc; i++)
+        printf("%s%s", argv[i], i == argc - 1 ? "" : " ");
+    printf("\n");
+    return 0;
+}
+
+static const struct embedded_cli_command commands[] = {
+    {"quit", cmd_quit, "Exit the demo"},
+    {"echo", cmd_echo, "Print the arguments"},
+};
+#endif
+
 int main(void)
 {
     bool done = false;
@@ -78,20 +184,74 @@ int main(void)
      * callbacks/userdata
      */
     embedded_cli_init(&cli, "POSIX> ", posix_putch, stdout);
+#if EMBEDDED_CLI_OUTPUT_BUF_LEN
+    embedded_cli_set_put_buf(&cli, posix_putbuf);
+#endif
+#if EMBEDDED_CLI_TX_BUF_LEN
+    embedded_cli_set_tx_policy(&cli, EMBEDDED_CLI_TX_BLOCK, posix_tx_drain);
+#endif
+#if EMBEDDED_CLI_HISTORY_STORE
+    history_fd = open(HISTORY_FILE, O_RDWR | O_CREAT, 0600);
+    if (history_fd < 0)
+        perror(HISTORY_FILE);
+    else
+        embedded_cli_history_load(&cli, &history_store);
+#endif
+#if EMBEDDED_CLI_MAX_COMMANDS
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+        embedded_cli_register_command(&cli, &commands[i]);
+#endif
     embedded_cli_prompt(&cli);
 
-    /* Capture Ctrl-C */
-    signal(SIGINT, intHandler);
+    /* Capture Ctrl-C. Without SA_RESTART, read() is interrupted too */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = intHandler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
 
     while (!done) {
-        char ch = getch();
+        int ch;
+        bool have_line = false;
+
+#if EMBEDDED_CLI_TX_BUF_LEN
+        posix_tx_drain(stdout);
+#endif
+        ch = getch();
+
+        if (interrupted) {
+            interrupted = 0;
+#if EMBEDDED_CLI_RX_BUF_LEN
+            /**
+             * Process what the signal handler put in the receive ring, the
+             * way a main loop would after a UART interrupt
+             */
+            embedded_cli_poll(&cli);
+#else
+            embedded_cli_insert_char(&cli, '\x03');
+#endif
+        }
+        if (ch >= 0)
+            have_line = embedded_cli_insert_char(&cli, (char)ch);
+#if EMBEDDED_CLI_TX_BUF_LEN
+        // Get the echo out before any command output
+        posix_tx_drain(stdout);
+#endif
 
         /**
          * If we have entered a command, try and process it
          */
-        if (embedded_cli_insert_char(&cli, ch)) {
+        if (have_line) {
             int cli_argc;
             char **cli_argv;
+#if EMBEDDED_CLI_MAX_COMMANDS
+            if (embedded_cli_dispatch(&cli, NULL)) {
+                done = quit;
+                if (!done)
+                    embedded_cli_prompt(&cli);
+                continue;
+            }
+#endif
             cli_argc = embedded_cli_argc(&cli, &cli_argv);
             printf("Got %d args\n", cli_argc);
             for (int i = 0; i < cli_argc; i++) {
@@ -105,5 +265,13 @@ int main(void)
         }
     }
 
+#if EMBEDDED_CLI_BRACKETED_PASTE
+    // Leave the terminal the way we found it
+    printf("\x1b[?2004l");
+#endif
+#if EMBEDDED_CLI_HISTORY_STORE
+    if (history_fd >= 0)
+        close(history_fd);
+#endif
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,304 @@
+/**
+ * Host microbenchmarks for EmbeddedCLI.
+ * Each workload is run repeatedly for a fixed amount of wall clock time, and
+ * the results are printed as a tab separated table (workload, metric, value,
+ * unit) so that they can be compared between releases with standard tools.
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "embedded_cli.h"
+
+#define CSI "\x1b["
+#define UP CSI "A"
+#define DOWN CSI "B"
+#define LEFT CSI "D"
+
+/* How long to spend on each workload */
+#define BENCH_NSEC 200000000ULL
+
+/* Number of times to repeat the embedded_cli_argc measurement */
+#define ARGC_ROUNDS 7
+
+/* Make the compiler assume the memory at p is used, and may be changed */
+#define BENCH_CLOBBER(p) __asm__ volatile("" : : "r"(p) : "memory")
+
+static volatile int argc_sink;
+
+static unsigned long long output_bytes;
+
+static void bench_putchar(void *data, char ch, bool is_last)
+{
+    (void)data;
+    (void)ch;
+    (void)is_last;
+    output_bytes++;
+}
+
+static unsigned long long now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL +
+           (unsigned long long)ts.tv_nsec;
+}
+
+static void report(const char *workload, const char *metric, double value,
+                   const char *unit)
+{
+    printf("%s\t%s\t%.2f\t%s\n", workload, metric, value, unit);
+}
+
+static void feed(struct embedded_cli *cli, const char *s)
+{
+    while (*s)
+        embedded_cli_insert_char(cli, *s++);
+}
+
+/**
+ * Run one keystroke workload until the time budget is used up, and report
+ * throughput and the number of bytes sent to the terminal per keystroke
+ */
+static void bench_keys(const char *name, const char *setup, const char *keys)
+{
+    struct embedded_cli cli;
+    unsigned long long start, elapsed, chars = 0;
+    size_t len = strlen(keys);
+
+    embedded_cli_init(&cli, "> ", bench_putchar, NULL);
+    feed(&cli, setup);
+    output_bytes = 0;
+    start = now_nsec();
+    do {
+        for (int i = 0; i < 64; i++)
+            feed(&cli, keys);
+        chars += 64 * len;
+        elapsed = now_nsec() - start;
+    } while (elapsed < BENCH_NSEC);
+
+    report(name, "chars_per_sec", (double)chars * 1e9 / (double)elapsed,
+           "chars/s");
+    report(name, "output_per_key", (double)output_bytes / (double)chars,
+           "bytes");
+}
+
+/**
+ * Measure pasting a large block through embedded_cli_insert_buffer
+ */
+static void bench_paste(void)
+{
+    static char block[4096];
+    struct embedded_cli cli;
+    unsigned long long start, elapsed, chars = 0;
+
+    for (size_t i = 0; i < sizeof(block); i++)
+        block[i] = (i % 64) == 63 ? '\n' : (char)('a' + i % 26);
+
+    embedded_cli_init(&cli, "> ", bench_putchar, NULL);
+    output_bytes = 0;
+    start = now_nsec();
+    do {
+        for (size_t pos = 0; pos < sizeof(block);) {
+            pos += embedded_cli_insert_buffer(&cli, &block[pos],
+                                              sizeof(block) - pos);
+            embedded_cli_prompt(&cli);
+        }
+        chars += sizeof(block);
+        elapsed = now_nsec() - start;
+    } while (elapsed < BENCH_NSEC);
+
+    report("paste", "chars_per_sec", (double)chars * 1e9 / (double)elapsed,
+           "chars/s");
+    report("paste", "output_per_key", (double)output_bytes / (double)chars,
+           "bytes");
+}
+
+/**
+ * Time n calls of embedded_cli_argc, each on a fresh copy of a CLI which
+ * has a complete line waiting (as the line is split up in place). With
+ * parse false, only the copy is done
+ */
+static double time_argc(const struct embedded_cli *base, bool parse,
+                        unsigned long long n)
+{
+    static struct embedded_cli cli;
+    unsigned long long start = now_nsec();
+    char **argv;
+
+    for (unsigned long long i = 0; i < n; i++) {
+        cli = *base;
+        // Stop the compiler from skipping the copy, or moving it out of
+        // the loop
+        BENCH_CLOBBER(&cli);
+        if (parse)
+            argc_sink += embedded_cli_argc(&cli, &argv);
+    }
+    return (double)(now_nsec() - start) / (double)n;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+/**
+ * Measure the cost of entering a line, and of splitting it into arguments
+ * with embedded_cli_argc (destructive) and embedded_cli_args (in place).
+ * embedded_cli_argc is timed on a copy of the CLI made before each call,
+ * with the time taken by the copy alone measured separately and taken
+ * off. This is repeated several times, and the median reported along with
+ * the spread, so that an unreliable result can be seen as such
+ */
+static void bench_argc(const char *name, const char *line)
+{
+    static struct embedded_cli base;
+    struct embedded_cli cli;
+    struct embedded_cli_arg args[EMBEDDED_CLI_MAX_ARGC];
+    unsigned long long start, elapsed, calls = 0;
+    double argc_ns[ARGC_ROUNDS], spread, median;
+    volatile int sink = 0;
+
+    embedded_cli_init(&cli, "> ", bench_putchar, NULL);
+    start = now_nsec();
+    do {
+        for (int i = 0; i < 64; i++)
+            feed(&cli, line);
+        calls += 64;
+        elapsed = now_nsec() - start;
+    } while (elapsed < BENCH_NSEC);
+    report(name, "line_entry", (double)elapsed / (double)calls, "ns");
+
+    embedded_cli_init(&base, "> ", bench_putchar, NULL);
+    feed(&base, line);
+    // Work out how many calls fill a round
+    calls = 64;
+    while (calls < (1ULL << 32) &&
+           time_argc(&base, true, calls) * (double)calls <
+               BENCH_NSEC / ARGC_ROUNDS / 2)
+        calls *= 2;
+    for (int r = 0; r < ARGC_ROUNDS; r++) {
+        double copy = time_argc(&base, false, calls);
+        argc_ns[r] = time_argc(&base, true, calls) - copy;
+    }
+    qsort(argc_ns, ARGC_ROUNDS, sizeof(argc_ns[0]), compare_double);
+    median = argc_ns[ARGC_ROUNDS / 2];
+    spread = argc_ns[ARGC_ROUNDS - 1] - argc_ns[0];
+    report(name, "argc", median, "ns");
+    report(name, "argc_spread", spread, "ns");
+    if (median <= 0 || spread > median / 2)
+        fprintf(stderr,
+                "%s: argc timing is unreliable (median %.2f ns, spread "
+                "%.2f ns)\n",
+                name, median, spread);
+
+    calls = 0;
+    feed(&cli, line);
+    start = now_nsec();
+    do {
+        for (int i = 0; i < 64; i++)
+            sink += embedded_cli_args(&cli, args, EMBEDDED_CLI_MAX_ARGC);
+        calls += 64;
+        elapsed = now_nsec() - start;
+    } while (elapsed < BENCH_NSEC);
+    (void)sink;
+    report(name, "args", (double)elapsed / (double)calls, "ns");
+}
+
+/**
+ * Time a line made up entirely of one pattern of quotes or escapes, which
+ * is the worst case for the argument parser
+ */
+static void bench_argc_repeated(const char *name, const char *pattern)
+{
+    char line[EMBEDDED_CLI_MAX_LINE + 1];
+    size_t len = 0;
+
+    while (len + strlen(pattern) < EMBEDDED_CLI_MAX_LINE) {
+        memcpy(&line[len], pattern, strlen(pattern));
+        len += strlen(pattern);
+    }
+    strcpy(&line[len], "\n");
+    bench_argc(name, line);
+}
+
+#if EMBEDDED_CLI_HISTORY_LEN
+/**
+ * Fill the history, then measure walking all the way back through it and
+ * forward again
+ */
+static void bench_history(void)
+{
+    struct embedded_cli cli;
+    unsigned long long start, elapsed, keys = 0;
+    int depth = 0;
+    char line[32];
+
+    embedded_cli_init(&cli, "> ", bench_putchar, NULL);
+    for (int i = 0; i < 4 * EMBEDDED_CLI_HISTORY_LEN / 16; i++) {
+        snprintf(line, sizeof(line), "history entry %d\n", i);
+        feed(&cli, line);
+    }
+    while (embedded_cli_get_history(&cli, depth))
+        depth++;
+    report("history", "entries", depth, "lines");
+
+    output_bytes = 0;
+    start = now_nsec();
+    do {
+        for (int i = 0; i < depth; i++)
+            feed(&cli, UP);
+        for (int i = 0; i < depth; i++)
+            feed(&cli, DOWN);
+        keys += 2 * (unsigned long long)depth;
+        elapsed = now_nsec() - start;
+    } while (elapsed < BENCH_NSEC);
+
+    report("history", "ns_per_key", (double)elapsed / (double)keys, "ns");
+    report("history", "output_per_key", (double)output_bytes / (double)keys,
+           "bytes");
+
+    start = now_nsec();
+    keys = 0;
+    do {
+        // Search for the oldest entry, which has to skip all the others
+        feed(&cli, "\x12"
+                   "entry 0\x03");
+        keys += 9;
+        elapsed = now_nsec() - start;
+    } while (elapsed < BENCH_NSEC);
+    report("history_search", "ns_per_key", (double)elapsed / (double)keys,
+           "ns");
+}
+#endif
+
+int main(void)
+{
+    printf("workload\tmetric\tvalue\tunit\n");
+
+    bench_keys("typing", "", "the quick brown fox jumps over the lazy dog\n");
+    bench_keys("midline_edit",
+               "0123456789012345678901234567890123456789012345678901234",
+               LEFT LEFT LEFT LEFT LEFT LEFT LEFT LEFT "xyz\b\b\b\x05");
+    // Fill most of the line, then clear it with ^U
+    bench_keys("long_line", "",
+               "abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz"
+               "0123456789abcdefghijklmnopqrstuvwxyz0123456789\x15");
+    bench_paste();
+    bench_argc("argc_plain", "set the value of something to 10\n");
+    bench_argc("argc_quotes",
+               "echo \"quoted \\\"string\\\"\" 'single quoted' \"a b\" "
+               "c\\ d \"\" ''\n");
+    bench_argc_repeated("argc_all_dquotes", "\"");
+    bench_argc_repeated("argc_all_squotes", "'");
+    bench_argc_repeated("argc_all_empty_quotes", "''");
+    bench_argc_repeated("argc_all_escapes", "\\a");
+#if EMBEDDED_CLI_HISTORY_LEN
+    bench_history();
+#endif
+
+    return 0;
+}
@@ -1,16 +1,81 @@
 #include "embedded_cli.c"
 
+#if EMBEDDED_CLI_HISTORY_STORE
+struct fuzz_store {
+    const char *data;
+    size_t size;
+};
+
+static size_t fuzz_read(void *data, size_t offset, void *buf, size_t len)
+{
+    struct fuzz_store *f = data;
+    if (offset >= f->size)
+        return 0;
+    if (len > f->size - offset)
+        len = f->size - offset;
+    memcpy(buf, &f->data[offset], len);
+    return len;
+}
+
+static bool fuzz_write(void *data, size_t offset, const void *buf,
+                       size_t len)
+{
+    (void)data;
+    (void)offset;
+    (void)buf;
+    (void)len;
+    return true;
+}
+#endif
+
 int LLVMFuzzerTestOneInput(const char *data, int size)
 {
     struct embedded_cli cli;
     char **argv;
+    struct embedded_cli_arg args[EMBEDDED_CLI_MAX_ARGC];
 
     embedded_cli_init(&cli, NULL, NULL, NULL);
 
     for (int i = 0; i < size; i++)
         embedded_cli_insert_char(&cli, data[i]);
 
+    int nargs = embedded_cli_args(&cli, args, EMBEDDED_CLI_MAX_ARGC);
+    for (int i = 0; i < nargs; i++) {
+        char value[8];
+        embedded_cli_arg_copy(&cli, &args[i], value, sizeof(value));
+        embedded_cli_arg_equals(&cli, &args[i], value);
+    }
     embedded_cli_argc(&cli, &argv);
     embedded_cli_get_history(&cli, 0);
+
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    for (size_t pos = 0; pos < (size_t)size;)
+        pos += embedded_cli_insert_buffer(&cli, &data[pos],
+                                          (size_t)size - pos);
+    embedded_cli_argc(&cli, &argv);
+
+#if EMBEDDED_CLI_TX_BUF_LEN
+    // Drain the transmit buffer slowly, so that output gets dropped
+    embedded_cli_init(&cli, "> ", NULL, NULL);
+    embedded_cli_set_tx_policy(&cli, EMBEDDED_CLI_TX_DROP, NULL);
+    for (int i = 0; i < size; i++) {
+        const char *buf;
+        size_t len;
+        embedded_cli_insert_char(&cli, data[i]);
+        len = embedded_cli_tx_peek(&cli, &buf);
+        embedded_cli_tx_ack(&cli, len > 2 ? 2 : len);
+    }
+#endif
+
+#if EMBEDDED_CLI_HISTORY_STORE
+    // Treat the input as a stored history
+    struct fuzz_store f = {data, (size_t)size};
+    struct embedded_cli_history_store store = {fuzz_read, fuzz_write, &f,
+                                               (size_t)size};
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    embedded_cli_history_load(&cli, &store);
+    for (int i = 0; embedded_cli_get_history(&cli, i); i++)
+        ;
+#endif
     return 0;
 }
@@ -1,3 +1,9 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/time.h>
+
 #include "acutest.h"
 #include "embedded_cli.h"
 
@@ -11,6 +17,8 @@
 #define HOME CSI "H"
 #define END CSI "F"
 #define DELETE CSI "3~"
+#define MOVE_BOL "\r"
+#define CLEAR_EOL CSI "K"
 #define CTRL_A "\x01"
 #define CTRL_C "\x03"
 #define CTRL_E "\x05"
@@ -20,6 +28,15 @@
 #define CTRL_U "\x15"
 #define CTRL_X "\x18"
 
+#if EMBEDDED_CLI_BRACKETED_PASTE
+// Sent along with the prompt
+#define PASTE_ON CSI "?2004h"
+#define PASTE_START CSI "200~"
+#define PASTE_END CSI "201~"
+#else
+#define PASTE_ON ""
+#endif
+
 static void cli_equals(const struct embedded_cli *cli, const char *line)
 {
     const char *cli_line = embedded_cli_get_line(cli);
@@ -86,6 +103,78 @@ static void test_cursor_right(void)
     cli_equals(&cli, "ACB");
 }
 
+static void test_escape_keys(void)
+{
+    struct {
+        const char *terminal;
+        const char *input;
+        const char *output;
+    } test_cases[] = {
+        // Cursor keys in normal and application mode
+        {"xterm", "one two" CSI "H" "X", "Xone two"},
+        {"xterm", "one two" CSI "H" CSI "F" "X", "one twoX"},
+        {"xterm", "one two" CSI "2D" "X", "one tXwo"},
+        {"xterm", "one two" "\x1bOH" "X", "Xone two"},
+        {"xterm", "one two" "\x1bOH" "\x1bOF" "X", "one twoX"},
+        // Ctrl, alt and shift with the cursor keys
+        {"xterm", "one two three" CSI "1;5D" "X", "one two Xthree"},
+        {"xterm", "one two three" CSI "1;5D" CSI "1;5D" "X",
+         "one Xtwo three"},
+        {"xterm", "one two three" CSI "1;3D" "X", "one two Xthree"},
+        {"xterm", "one two three" CSI "1;2D" "X", "one two threXe"},
+        {"xterm", "one two" CSI "H" CSI "1;5C" "X", "oneX two"},
+        {"xterm", "one two" CSI "1;5H" "X", "Xone two"},
+        {"xterm", "one two" LEFT CSI "3;5~", "one tw"},
+        {"xterm", "one two" "\x1bO5D" "X", "one Xtwo"},
+        {"vt100", "one two" "\x1bOD" "\x1bOD" "X", "one tXwo"},
+        {"vt100", "one two" "\x1bOD" "\x1bOD" "\x1bOC" "X", "one twXo"},
+        {"putty", "one two" CSI "1~" "X", "Xone two"},
+        {"putty", "one two" CSI "1~" CSI "4~" "X", "one twoX"},
+        {"putty", "one two" CSI "1~" CSI "3~", "ne two"},
+        {"rxvt", "one two" CSI "7~" "X", "Xone two"},
+        {"rxvt", "one two" CSI "7~" CSI "8~" "X", "one twoX"},
+        {"rxvt", "one two three" "\x1bOd" "X", "one two Xthree"},
+        {"rxvt", "one two" CSI "7~" "\x1bOc" "X", "oneX two"},
+        {"macos", "one two three" "\x1b" "b" "\x1b" "b" "X",
+         "one Xtwo three"},
+        {"macos", "one two" CSI "H" "\x1b" "f" "X", "oneX two"},
+        // Sequences which aren't keys are dropped, without leaving anything
+        // behind on the line
+        {"xterm", "a" CSI "?1;2c" "b", "ab"},
+        {"xterm", "a" CSI "24~" "b", "ab"},
+        {"xterm", "a" CSI "1;5;7;9A" "b", "ab"},
+        {"xterm", "a" "\x1bOP" "b", "ab"},
+        {"xterm", "a" CSI "2001~" "b", "ab"},
+        {"xterm", "a" CSI "99999D" "b", "ab"},
+        // A sequence cut short by a control character is abandoned, and the
+        // control character still works
+        {"xterm", "ab" CSI "1" CTRL_A "X", "Xab"},
+        {"xterm", "ab" "\x1b" "x", "abx"},
+        {NULL, NULL, NULL},
+    };
+    struct embedded_cli cli;
+    for (int i = 0; test_cases[i].input; i++) {
+        embedded_cli_init(&cli, NULL, NULL, NULL);
+        test_insert_line(&cli, test_cases[i].input);
+        test_insert_line(&cli, "\n");
+        TEST_CHECK_(strcmp(embedded_cli_get_line(&cli),
+                           test_cases[i].output) == 0,
+                    "%d (%s): expected '%s' got '%s'", i,
+                    test_cases[i].terminal, test_cases[i].output,
+                    embedded_cli_get_line(&cli));
+    }
+
+#if EMBEDDED_CLI_HISTORY_LEN
+    // Application mode up/down move through the history too
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    test_insert_line(&cli, "first\nsecond\n");
+    test_insert_line(&cli, "\x1bOA\x1bOA\x1bOB\n");
+    cli_equals(&cli, "second");
+    test_insert_line(&cli, CSI "1;5A\n");
+    cli_equals(&cli, "second");
+#endif
+}
+
 #if EMBEDDED_CLI_HISTORY_LEN
 static void test_history(void)
 {
@@ -103,6 +192,168 @@ static void test_history(void)
     TEST_ASSERT(line && strcmp(line, "First") == 0);
 }
 
+static void test_history_wrap(void)
+{
+    struct embedded_cli cli;
+    char line[32];
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    for (int i = 0; i < 500; i++) {
+        size_t retained = 0;
+        int n;
+        snprintf(line, sizeof(line), "command %d%*s\n", i, i % 13, "");
+        test_insert_line(&cli, line);
+        // Walk back through the history, make sure everything is in order
+        for (n = 0; n <= i; n++) {
+            const char *h = embedded_cli_get_history(&cli, n);
+            if (!h)
+                break;
+            snprintf(line, sizeof(line), "command %d%*s", i - n,
+                     (i - n) % 13, "");
+            TEST_ASSERT_(strcmp(h, line) == 0, "%d: Expected '%s' got '%s'",
+                         n, line, h);
+            retained += strlen(h) + 1;
+        }
+        TEST_ASSERT(n > 0);
+        TEST_ASSERT(n <= EMBEDDED_CLI_HISTORY_ENTRIES);
+#if !EMBEDDED_CLI_HISTORY_COMPRESS
+        TEST_ASSERT(retained <= EMBEDDED_CLI_HISTORY_LEN);
+#endif
+        // We should only ever waste at most one line's worth of space
+        if (n <= i && n < EMBEDDED_CLI_HISTORY_ENTRIES)
+            TEST_ASSERT(retained + 2 * sizeof(line) >
+                        EMBEDDED_CLI_HISTORY_LEN);
+    }
+}
+
+#if EMBEDDED_CLI_HISTORY_COMPRESS
+static void test_history_compress(void)
+{
+    struct embedded_cli cli;
+    char line[EMBEDDED_CLI_MAX_LINE];
+    int count = EMBEDDED_CLI_HISTORY_ENTRIES;
+    const char *prefix = "net iface eth0 route add 192.168.100.0/24 via ";
+    size_t full = 0;
+
+    // Every EMBEDDED_CLI_HISTORY_RESTART entries one is stored in full
+    // (under 64 bytes), and the rest take under 8 bytes each. Only ask for
+    // as many as will fit
+    while (count > 1) {
+        int restarts = (count + EMBEDDED_CLI_HISTORY_RESTART - 1) /
+                       EMBEDDED_CLI_HISTORY_RESTART;
+        if (restarts * 64 + count * 8 <= EMBEDDED_CLI_HISTORY_LEN)
+            break;
+        count--;
+    }
+
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    for (int i = 0; i < count; i++) {
+        snprintf(line, sizeof(line), "%s10.0.%d.1\n", prefix, i);
+        test_insert_line(&cli, line);
+        full += strlen(line);
+    }
+    // Stored in full, these wouldn't fit (unless there's room for every
+    // entry anyway)
+    TEST_CHECK(full > EMBEDDED_CLI_HISTORY_LEN ||
+               count == EMBEDDED_CLI_HISTORY_ENTRIES);
+    for (int i = 0; i < count; i++) {
+        const char *h = embedded_cli_get_history(&cli, count - 1 - i);
+        snprintf(line, sizeof(line), "%s10.0.%d.1", prefix, i);
+        TEST_ASSERT_(h && strcmp(h, line) == 0, "%d: Expected '%s' got '%s'",
+                     i, line, h ? h : "(null)");
+    }
+    test_insert_line(&cli, UP UP "\n");
+    snprintf(line, sizeof(line), "%s10.0.%d.1", prefix, count - 2);
+    cli_equals(&cli, line);
+}
+
+#if EMBEDDED_CLI_HISTORY_LEN < EMBEDDED_CLI_MAX_LINE
+static void test_history_too_long(void)
+{
+    struct embedded_cli cli;
+    char line[EMBEDDED_CLI_MAX_LINE];
+
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    for (int i = 0; i < EMBEDDED_CLI_HISTORY_ENTRIES; i++) {
+        snprintf(line, sizeof(line), "%d\n", i);
+        test_insert_line(&cli, line);
+    }
+    // With its shared count, this is a byte too long to be stored, so it
+    // mustn't push out the oldest entry either
+    memset(line, 'x', EMBEDDED_CLI_HISTORY_LEN - 1);
+    strcpy(&line[EMBEDDED_CLI_HISTORY_LEN - 1], "\n");
+    test_insert_line(&cli, line);
+    for (int i = 0; i < EMBEDDED_CLI_HISTORY_ENTRIES; i++) {
+        const char *h = embedded_cli_get_history(&cli, i);
+        snprintf(line, sizeof(line), "%d",
+                 EMBEDDED_CLI_HISTORY_ENTRIES - 1 - i);
+        TEST_ASSERT_(h && strcmp(h, line) == 0, "%d: Expected '%s' got '%s'",
+                     i, line, h ? h : "(null)");
+    }
+}
+#endif
+#endif
+
+#if EMBEDDED_CLI_HISTORY_DEDUP
+static void test_history_dedup(void)
+{
+    struct embedded_cli cli;
+    const char *model[100];
+    char lines[100][64];
+    int model_len = 0;
+    unsigned int seed = 1;
+
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    test_insert_line(&cli, "first\nsecond\nfirst\nsecond\nthird\nfirst\n");
+    TEST_CHECK(strcmp(embedded_cli_get_history(&cli, 0), "first") == 0);
+    TEST_CHECK(strcmp(embedded_cli_get_history(&cli, 1), "third") == 0);
+    TEST_CHECK(strcmp(embedded_cli_get_history(&cli, 2), "second") == 0);
+    TEST_CHECK(embedded_cli_get_history(&cli, 3) == NULL);
+
+    // Repeat a small set of commands, so that entries are brought to the
+    // front while others get discarded. The history should always be the
+    // most recently used commands, newest first, with some possibly
+    // missing as their space got reused
+    for (int i = 0; i < 100; i++)
+        snprintf(lines[i], sizeof(lines[i]), "command %d %.*s", i, i % 37,
+                 "abcdefghijklmnopqrstuvwxyz0123456789");
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    for (int i = 0; i < 2000; i++) {
+        const char *line;
+        int m = 0;
+
+        seed = seed * 1103515245 + 12345;
+        line = lines[(seed >> 16) % (i < 1000 ? 100 : 10)];
+        test_insert_line(&cli, line);
+        test_insert_line(&cli, "\n");
+
+        // Most recently used first, with no duplicates
+        for (int j = 0; j < model_len; j++) {
+            if (model[j] == line) {
+                memmove(&model[j], &model[j + 1],
+                        (size_t)(model_len - j - 1) * sizeof(model[0]));
+                model_len--;
+                break;
+            }
+        }
+        memmove(&model[1], &model[0], (size_t)model_len * sizeof(model[0]));
+        model[0] = line;
+        model_len++;
+
+        TEST_ASSERT(strcmp(embedded_cli_get_history(&cli, 0), line) == 0);
+        for (int n = 0; embedded_cli_get_history(&cli, n); n++) {
+            const char *h = embedded_cli_get_history(&cli, n);
+            while (m < model_len && strcmp(model[m], h) != 0)
+                m++;
+            TEST_ASSERT_(m < model_len, "%d: '%s' out of order", i, h);
+            m++;
+        }
+    }
+    // With only 10 commands in use, they should all fit
+    for (int n = 0; n < 10; n++)
+        TEST_CHECK(strcmp(embedded_cli_get_history(&cli, n), model[n]) == 0);
+}
+#endif
+
 static void test_history_keys(void)
 {
     struct embedded_cli cli;
@@ -125,15 +376,44 @@ static void test_search(void)
     cli_equals(&cli, "Second");
 }
 
+static void test_search_repeat(void)
+{
+    struct embedded_cli cli;
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    test_insert_line(&cli, "set foo 1\n");
+    test_insert_line(&cli, "get foo\n");
+    test_insert_line(&cli, "set bar 2\n");
+    test_insert_line(&cli, "reset\n");
+    test_insert_line(&cli, CTRL_R "set\n");
+    cli_equals(&cli, "reset");
+    test_insert_line(&cli, CTRL_R "set " CTRL_R "\n");
+    cli_equals(&cli, "set foo 1");
+    // Running out of older matches should leave the oldest one
+    test_insert_line(&cli, CTRL_R "foo" CTRL_R CTRL_R CTRL_R "\n");
+#if EMBEDDED_CLI_HISTORY_DEDUP
+    // "set foo 1" was brought to the front, rather than stored again
+    cli_equals(&cli, "get foo");
+#else
+    cli_equals(&cli, "set foo 1");
+#endif
+    // Extending the search term at the start
+    test_insert_line(&cli, CTRL_R "bar" CTRL_A "set \n");
+    cli_equals(&cli, "set bar 2");
+    test_insert_line(&cli, CTRL_R "nothing\n");
+    cli_equals(&cli, "");
+}
+
 static char output[1024];
 
 // Super minimal tty code interpreter so we can work out what
 // the user's display looks like
+static int output_pos = 0;
+
 static void output_putchar(void *data, char ch, bool is_last)
 {
-    static int output_pos = 0;
     static bool have_escape = false;
     static bool have_csi = false;
+    static int param = 0;
     (void)is_last;
     (void)data;
     if (ch == '\x1b') {
@@ -142,20 +422,32 @@ static void output_putchar(void *data, char ch, bool is_last)
         return;
     } else if (have_escape && ch == '[') {
         have_csi = true;
+        have_escape = false;
+        param = 0;
         return;
     }
 
     if (have_csi) {
-        // just ignore them
-        if (ch >= 'A' && ch <= 'Z') {
+        if (ch >= '0' && ch <= '9') {
+            param = param * 10 + (ch - '0');
+        } else if (ch >= '@' && ch <= '~') {
+            int n = param ? param : 1;
             if (ch == 'K') // CLEAR_EOL
                 memset(&output[output_pos], 0,
                        sizeof(output) - (size_t)output_pos);
+            else if (ch == 'C')
+                output_pos += n;
+            else if (ch == 'D')
+                output_pos = output_pos > n ? output_pos - n : 0;
+            else if (ch == 'G')
+                output_pos = n - 1;
             have_csi = false;
         }
     } else {
         if (ch == '\b') {
             output_pos = output_pos > 0 ? output_pos - 1 : 0;
+        } else if (ch == '\r') {
+            output_pos = 0;
         } else if (ch == '\n') {
             output_pos = 0;
             memset(output, 0, sizeof(output));
@@ -250,9 +542,310 @@ static void test_echo(void)
     embedded_cli_init(&cli, "prompt> ", callback, output);
     embedded_cli_prompt(&cli);
     test_insert_line(&cli, "foo\n");
-    TEST_ASSERT(strcmp(output, "prompt> foo\r\n") == 0);
+    TEST_ASSERT(strcmp(output, PASTE_ON "prompt> foo\r\n") == 0);
+}
+
+static void test_redraw(void)
+{
+    struct {
+        const char *input;
+        const char *output;
+    } test_cases[] = {
+        {"hello world", "hello world"},
+        {HOME, "\r> "},
+        {END, CSI "11C"},
+        {"\b", "\b \b"},
+        {LEFT LEFT LEFT "\b", "\b\b\b\borl \b\b\b\b"},
+        {CTRL_K, CSI "K"},
+        {CTRL_A CTRL_E, "\r> " CSI "6C"},
+        {NULL, NULL},
+    };
+    struct embedded_cli cli;
+    char raw[MAX_OUTPUT_LEN];
+    embedded_cli_init(&cli, "> ", callback, raw);
+    for (int i = 0; test_cases[i].input; i++) {
+        raw[0] = '\0';
+        test_insert_line(&cli, test_cases[i].input);
+        TEST_ASSERT_(strcmp(raw, test_cases[i].output) == 0, "%d: got '%s'",
+                     i, raw);
+    }
+}
+
+static void test_deferred_redraw(void)
+{
+    const char edits[] = "ab" LEFT LEFT "\b" DELETE;
+    struct embedded_cli cli;
+    char raw[MAX_OUTPUT_LEN] = "\0";
+    embedded_cli_init(&cli, "> ", callback, raw);
+    test_insert_line(&cli, "tail" HOME);
+
+    // Inserting a block in front of existing text only reprints the tail
+    // once
+    raw[0] = '\0';
+    embedded_cli_insert_buffer(&cli, "0123456789", 10);
+    TEST_ASSERT_(strcmp(raw, "0123456789tail\b\b\b\b") == 0, "Got '%s'",
+                 raw);
+    raw[0] = '\0';
+    embedded_cli_insert_buffer(&cli, edits, sizeof(edits) - 1);
+    TEST_ASSERT_(strcmp(raw, "\bbtail" CSI "5D") == 0, "Got '%s'", raw);
+    test_insert_line(&cli, "\n");
+    cli_equals(&cli, "012345678btail");
+
+    // Nothing is output while more input is flagged as on the way
+    embedded_cli_init(&cli, "> ", callback, raw);
+    raw[0] = '\0';
+    embedded_cli_set_input_pending(&cli, true);
+    test_insert_line(&cli, "ab" LEFT "c");
+    TEST_ASSERT(raw[0] == '\0');
+    embedded_cli_set_input_pending(&cli, false);
+    TEST_ASSERT_(strcmp(raw, "acb\b") == 0, "Got '%s'", raw);
+
+    // Other output brings the screen up to date first
+    raw[0] = '\0';
+    embedded_cli_set_input_pending(&cli, true);
+    test_insert_line(&cli, "d\n");
+    TEST_ASSERT_(strcmp(raw, "db\b\r\n") == 0, "Got '%s'", raw);
+    embedded_cli_set_input_pending(&cli, false);
+    cli_equals(&cli, "acdb");
+}
+
+#if EMBEDDED_CLI_BRACKETED_PASTE
+static void test_bracketed_paste(void)
+{
+    const char multi[] = PASTE_START "one\rtwo\rthr" PASTE_END "ee\r";
+    const char *lines[] = {"one", "two", "three"};
+    struct embedded_cli cli;
+    char raw[MAX_OUTPUT_LEN] = "\0";
+    size_t pos = 0;
+    int count = 0;
+
+    embedded_cli_init(&cli, "> ", callback, raw);
+    embedded_cli_prompt(&cli);
+    TEST_ASSERT(strcmp(raw, PASTE_ON "> ") == 0);
+
+    // Pasted text is literal, and is echoed in one go
+    test_insert_line(&cli, "tail" HOME);
+    raw[0] = '\0';
+    test_insert_line(&cli, PASTE_START "a\tb" CTRL_A UP "c" PASTE_END);
+    TEST_ASSERT_(strcmp(raw, "a bctail\b\b\b\b") == 0, "Got '%s'", raw);
+    test_insert_line(&cli, "\n");
+    cli_equals(&cli, "a bctail");
+
+    // Each line of a multi-line paste is handed back separately
+    while (pos < sizeof(multi) - 1) {
+        pos += embedded_cli_insert_buffer(&cli, &multi[pos],
+                                          sizeof(multi) - 1 - pos);
+        if (embedded_cli_get_line(&cli)) {
+            TEST_ASSERT(count < 3);
+            cli_equals(&cli, lines[count++]);
+        }
+    }
+    TEST_ASSERT(count == 3);
+}
+#endif
+
+#if EMBEDDED_CLI_BATCH_MODE && EMBEDDED_CLI_MAX_COMMANDS
+static int batch_off_handler(struct embedded_cli *cli, int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    embedded_cli_set_batch(cli, false);
+    return 0;
 }
 
+static void test_batch(void)
+{
+    const char script[] = "set a 1\r\n" UP "\x7f\t\n\ninteractive\nb" LEFT;
+    const char *lines[] = {"set a 1", UP "\x7f\t", "", "interactive"};
+    static const struct embedded_cli_command command = {
+        "interactive", batch_off_handler, NULL};
+    struct embedded_cli cli;
+    char raw[MAX_OUTPUT_LEN] = "\0";
+    char long_line[EMBEDDED_CLI_MAX_LINE + 10];
+    size_t pos = 0;
+    int count = 0;
+
+    embedded_cli_init(&cli, "> ", callback, raw);
+    TEST_ASSERT(embedded_cli_register_command(&cli, &command));
+    embedded_cli_set_batch(&cli, true);
+    while (cli.batch) {
+        TEST_ASSERT(pos < sizeof(script) - 1);
+        pos += embedded_cli_insert_buffer(&cli, &script[pos],
+                                          sizeof(script) - 1 - pos);
+        if (embedded_cli_get_line(&cli)) {
+            TEST_ASSERT(count < 4);
+            cli_equals(&cli, lines[count++]);
+            // A command can put us back into interactive mode
+            embedded_cli_dispatch(&cli, NULL);
+        }
+    }
+    TEST_ASSERT(count == 4);
+    // Nothing is echoed or remembered
+    TEST_ASSERT(raw[0] == '\0');
+    TEST_ASSERT(embedded_cli_get_history(&cli, 0) == NULL);
+
+    // The rest is edited normally
+    embedded_cli_insert_buffer(&cli, &script[pos], sizeof(script) - 1 - pos);
+    test_insert_line(&cli, "a\n");
+    cli_equals(&cli, "ab");
+    TEST_ASSERT(raw[0] != '\0');
+
+    // Single characters work too, and overlong lines are cut short
+    embedded_cli_set_batch(&cli, true);
+    memset(long_line, 'x', sizeof(long_line));
+    for (size_t i = 0; i < sizeof(long_line); i++)
+        TEST_ASSERT(!embedded_cli_insert_char(&cli, long_line[i]));
+    TEST_ASSERT(embedded_cli_insert_char(&cli, '\n'));
+    TEST_ASSERT(strlen(embedded_cli_get_line(&cli)) ==
+                EMBEDDED_CLI_MAX_LINE - 1);
+
+#if EMBEDDED_CLI_SERIAL_XLATE
+    // As with interactive input, a carriage return on its own ends a line,
+    // and one followed by a newline is a single line ending, even when the
+    // pair is split up
+    const char cr_script[] = "one\rtwo\r\nthree\r";
+    const char *cr_lines[] = {"one", "two", "three", "four"};
+    pos = 0;
+    count = 0;
+    while (pos < sizeof(cr_script) - 1) {
+        pos += embedded_cli_insert_buffer(&cli, &cr_script[pos],
+                                          sizeof(cr_script) - 1 - pos);
+        if (embedded_cli_get_line(&cli)) {
+            TEST_ASSERT(count < 3);
+            cli_equals(&cli, cr_lines[count++]);
+        }
+    }
+    TEST_CHECK(!embedded_cli_insert_char(&cli, '\n'));
+    TEST_CHECK(embedded_cli_insert_buffer(&cli, "four\r\n", 6) == 5);
+    cli_equals(&cli, cr_lines[count++]);
+    TEST_CHECK(embedded_cli_insert_buffer(&cli, "\n", 1) == 1);
+    TEST_CHECK(embedded_cli_get_line(&cli) == NULL);
+    TEST_CHECK(count == 4);
+#endif
+
+#if EMBEDDED_CLI_BRACKETED_PASTE
+    // Switching modes part way through a paste abandons it, and shows what
+    // was held back, so that control keys work again afterwards
+    raw[0] = '\0';
+    embedded_cli_init(&cli, "> ", callback, raw);
+    test_insert_line(&cli, PASTE_START "ab");
+    TEST_CHECK(raw[0] == '\0');
+    embedded_cli_set_batch(&cli, true);
+    TEST_ASSERT_(strcmp(raw, "ab") == 0, "Got '%s'", raw);
+    embedded_cli_set_batch(&cli, false);
+    test_insert_line(&cli, CTRL_A "x\n");
+    cli_equals(&cli, "xab");
+#endif
+}
+#endif
+
+#if EMBEDDED_CLI_HISTORY_LEN
+/**
+ * Whatever sequence of edits is made, the terminal should end up showing
+ * the line, with the cursor in the right place
+ */
+static void test_redraw_random(void)
+{
+    struct embedded_cli cli;
+    const char *keys[] = {"a", "b",  "c",    "d",    LEFT,   RIGHT,  HOME,
+                          END, "\b", DELETE, CTRL_K, CTRL_U, CTRL_A, CTRL_E,
+                          UP,  DOWN, "\n"};
+    unsigned int seed = 1;
+    size_t len;
+    embedded_cli_init(&cli, "prompt> ", output_putchar, NULL);
+    output_putchar(NULL, '\n', true);
+    embedded_cli_prompt(&cli);
+    for (int i = 0; i < 5000; i++) {
+        seed = seed * 1103515245 + 12345;
+        test_insert_line(&cli, keys[(seed >> 16) % (sizeof(keys) /
+                                                     sizeof(keys[0]))]);
+        // Hold back screen updates for random stretches
+        if (((seed >> 8) & 7) == 0)
+            embedded_cli_set_input_pending(&cli, !cli.defer_output);
+        if (cli.done) {
+            embedded_cli_prompt(&cli);
+            continue;
+        }
+        if (cli.defer_output)
+            continue;
+        // Blanking with spaces is as good as clearing
+        len = strlen(output);
+        while (len > 8 && output[len - 1] == ' ')
+            len--;
+        TEST_ASSERT(strncmp(output, "prompt> ", 8) == 0);
+        TEST_ASSERT_(len - 8 == cli.len &&
+                         strncmp(&output[8], cli.buffer, cli.len) == 0,
+                     "%d: '%s' vs '%s'", i, &output[8], cli.buffer);
+        TEST_ASSERT(output_pos == 8 + (int)cli.cursor);
+    }
+}
+#endif
+
+static void test_insert_buffer(void)
+{
+    struct embedded_cli cli;
+    char output[MAX_OUTPUT_LEN] = "\0";
+    const char *input = "foo bar\nxy" LEFT "z\n" CTRL_A "a\n";
+    size_t len = strlen(input);
+    size_t pos;
+    embedded_cli_init(&cli, "prompt> ", callback, output);
+    embedded_cli_prompt(&cli);
+
+    pos = embedded_cli_insert_buffer(&cli, input, len);
+    TEST_ASSERT(pos == 8);
+    cli_equals(&cli, "foo bar");
+    TEST_ASSERT(strcmp(output, PASTE_ON "prompt> foo bar\r\n") == 0);
+
+    pos += embedded_cli_insert_buffer(&cli, &input[pos], len - pos);
+    cli_equals(&cli, "xzy");
+
+    pos += embedded_cli_insert_buffer(&cli, &input[pos], len - pos);
+    TEST_ASSERT(pos == len);
+    cli_equals(&cli, "a");
+
+    // Make sure a long run can't overflow the buffer
+    char big[EMBEDDED_CLI_MAX_LINE * 2];
+    memset(big, 'x', sizeof(big));
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    TEST_ASSERT(embedded_cli_insert_buffer(&cli, big, sizeof(big)) ==
+                sizeof(big));
+    TEST_ASSERT(embedded_cli_insert_buffer(&cli, "\n", 1) == 1);
+    TEST_ASSERT(strlen(embedded_cli_get_line(&cli)) ==
+                EMBEDDED_CLI_MAX_LINE - 1);
+}
+
+#if EMBEDDED_CLI_OUTPUT_BUF_LEN
+static int put_buf_calls;
+
+static void put_buf_callback(void *data, const char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        callback(data, buf[i], i == len - 1);
+    put_buf_calls++;
+}
+
+static void test_put_buf(void)
+{
+    struct embedded_cli cli;
+    char output[MAX_OUTPUT_LEN] = "\0";
+    embedded_cli_init(&cli, "prompt> ", NULL, output);
+    embedded_cli_set_put_buf(&cli, put_buf_callback);
+    put_buf_calls = 0;
+    embedded_cli_prompt(&cli);
+    TEST_ASSERT(put_buf_calls == 1);
+    test_insert_line(&cli, "fo" LEFT "o\n");
+    TEST_ASSERT(put_buf_calls == 6);
+    TEST_ASSERT(strcmp(output, PASTE_ON "prompt> fo\boo\b\r\n") == 0);
+
+    // A whole buffer should be written out in one go
+    output[0] = '\0';
+    put_buf_calls = 0;
+    embedded_cli_insert_buffer(&cli, "abc" LEFT "d", 8);
+    TEST_ASSERT(put_buf_calls == 1);
+    TEST_ASSERT(strcmp(output, "abdc\b") == 0);
+}
+#endif
+
 static void test_quotes(void)
 {
     struct embedded_cli cli;
@@ -269,6 +862,835 @@ static void test_quotes(void)
     TEST_ASSERT(strcmp(argv[5], "\"escape\"") == 0);
 }
 
+static void test_args(void)
+{
+    struct embedded_cli cli;
+    struct embedded_cli_arg args[EMBEDDED_CLI_MAX_ARGC];
+    const char *line = "  get foo\\ bar 'x y'z plain";
+    char value[10];
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    test_insert_line(&cli, line);
+    TEST_ASSERT(embedded_cli_args(&cli, args, EMBEDDED_CLI_MAX_ARGC) == 0);
+    test_insert_line(&cli, "\n");
+    TEST_ASSERT(embedded_cli_args(&cli, args, EMBEDDED_CLI_MAX_ARGC) == 4);
+
+    TEST_ASSERT(args[0].offset == 2 && args[0].len == 3);
+    TEST_ASSERT(args[0].flags == 0);
+    TEST_ASSERT(embedded_cli_arg_equals(&cli, &args[0], "get"));
+    TEST_ASSERT(!embedded_cli_arg_equals(&cli, &args[0], "ge"));
+    TEST_ASSERT(!embedded_cli_arg_equals(&cli, &args[0], "gets"));
+
+    TEST_ASSERT(args[1].flags & EMBEDDED_CLI_ARG_ESCAPED);
+    TEST_ASSERT(embedded_cli_arg_equals(&cli, &args[1], "foo bar"));
+    TEST_ASSERT(!embedded_cli_arg_equals(&cli, &args[1], "foo\\ bar"));
+    TEST_ASSERT(!embedded_cli_arg_equals(&cli, &args[1], "foo ba"));
+
+    TEST_ASSERT(embedded_cli_arg_equals(&cli, &args[2], "x yz"));
+    TEST_ASSERT(embedded_cli_arg_copy(&cli, &args[2], value,
+                                      sizeof(value)) == 4);
+    TEST_ASSERT(strcmp(value, "x yz") == 0);
+    TEST_ASSERT(embedded_cli_arg_copy(&cli, &args[1], value, 4) == 3);
+    TEST_ASSERT(strcmp(value, "foo") == 0);
+
+    TEST_ASSERT(embedded_cli_arg_equals(&cli, &args[3], "plain"));
+
+    // Only as many as requested
+    TEST_ASSERT(embedded_cli_args(&cli, args, 2) == 2);
+
+    // The line itself should be untouched
+    cli_equals(&cli, line);
+}
+
+#if EMBEDDED_CLI_MAX_COMMANDS
+static int command_handler(struct embedded_cli *cli, int argc, char **argv)
+{
+    (void)cli;
+    return argc * 100 + (int)strlen(argv[0]);
+}
+
+static void test_commands(void)
+{
+    static const struct embedded_cli_command commands[] = {
+        {"set", command_handler, "Set a value"},
+        {"get", command_handler, "Get a value"},
+        {"reset", command_handler, "Reset everything"},
+        {"a", command_handler, NULL},
+        {"zzzz", command_handler, NULL},
+    };
+    static const struct embedded_cli_command duplicate = {
+        "get", command_handler, NULL};
+    struct embedded_cli cli;
+    int ret = 0;
+
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+        TEST_ASSERT(embedded_cli_register_command(&cli, &commands[i]));
+    TEST_ASSERT(!embedded_cli_register_command(&cli, &duplicate));
+
+    TEST_ASSERT(embedded_cli_find_command(&cli, "get") == &commands[1]);
+    TEST_ASSERT(embedded_cli_find_command(&cli, "a") == &commands[3]);
+    TEST_ASSERT(embedded_cli_find_command(&cli, "zzzz") == &commands[4]);
+    TEST_ASSERT(embedded_cli_find_command(&cli, "ge") == NULL);
+    TEST_ASSERT(embedded_cli_find_command(&cli, "zzzzz") == NULL);
+
+    test_insert_line(&cli, "reset 'all of it' now\n");
+    TEST_ASSERT(embedded_cli_dispatch(&cli, &ret));
+    TEST_ASSERT(ret == 305);
+    test_insert_line(&cli, "  a\n");
+    TEST_ASSERT(embedded_cli_dispatch(&cli, NULL));
+    test_insert_line(&cli, "unknown 'command line'\n");
+    TEST_ASSERT(!embedded_cli_dispatch(&cli, &ret));
+    // It should still be possible to get at the arguments
+    char **argv;
+    TEST_ASSERT(embedded_cli_argc(&cli, &argv) == 2);
+    TEST_ASSERT(strcmp(argv[1], "command line") == 0);
+    test_insert_line(&cli, "\n");
+    TEST_ASSERT(!embedded_cli_dispatch(&cli, &ret));
+
+    // Fill up the rest of the table
+    static char names[EMBEDDED_CLI_MAX_COMMANDS][8];
+    static struct embedded_cli_command extra[EMBEDDED_CLI_MAX_COMMANDS];
+    size_t count = 0;
+    for (size_t i = 0; i < EMBEDDED_CLI_MAX_COMMANDS; i++) {
+        snprintf(names[i], sizeof(names[i]), "cmd%zu", i);
+        extra[i].name = names[i];
+        extra[i].handler = command_handler;
+        if (embedded_cli_register_command(&cli, &extra[i]))
+            count++;
+    }
+    TEST_ASSERT(count == EMBEDDED_CLI_MAX_COMMANDS -
+                             sizeof(commands) / sizeof(commands[0]));
+    TEST_ASSERT(embedded_cli_find_command(&cli, "cmd0") == &extra[0]);
+    TEST_ASSERT(embedded_cli_find_command(&cli, "get") == &commands[1]);
+}
+#endif
+
+#if EMBEDDED_CLI_LINKER_COMMANDS
+static int linker_handler(struct embedded_cli *cli, int argc, char **argv)
+{
+    (void)cli;
+    (void)argv;
+    return -argc;
+}
+
+EMBEDDED_CLI_COMMAND(version, linker_handler, "Show the version");
+EMBEDDED_CLI_COMMAND(status, linker_handler, "Show the status");
+EMBEDDED_CLI_COMMAND(get, linker_handler, "Hidden by the registered get");
+EMBEDDED_CLI_COMMAND(add, linker_handler, NULL);
+
+static void test_linker_commands(void)
+{
+    struct embedded_cli cli;
+    const struct embedded_cli_command *command;
+    int ret = 0;
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+
+    command = embedded_cli_find_command(&cli, "status");
+    TEST_ASSERT(command && strcmp(command->name, "status") == 0);
+    TEST_ASSERT(strcmp(command->help, "Show the status") == 0);
+    TEST_ASSERT(embedded_cli_find_command(&cli, "add") != NULL);
+    TEST_ASSERT(embedded_cli_find_command(&cli, "version") != NULL);
+    TEST_ASSERT(embedded_cli_find_command(&cli, "versio") == NULL);
+    TEST_ASSERT(embedded_cli_find_command(&cli, "zzz") == NULL);
+
+    test_insert_line(&cli, "version a b\n");
+    TEST_ASSERT(embedded_cli_dispatch(&cli, &ret));
+    TEST_ASSERT(ret == -3);
+
+#if EMBEDDED_CLI_MAX_COMMANDS
+    // Registered commands take precedence
+    static const struct embedded_cli_command get = {"get", command_handler,
+                                                    NULL};
+    TEST_ASSERT(embedded_cli_find_command(&cli, "get")->handler ==
+                linker_handler);
+    TEST_ASSERT(embedded_cli_register_command(&cli, &get));
+    TEST_ASSERT(embedded_cli_find_command(&cli, "get") == &get);
+#endif
+}
+#endif
+
+#if EMBEDDED_CLI_MAX_COMMANDS && EMBEDDED_CLI_LINKER_COMMANDS
+static void test_completion(void)
+{
+    static const struct embedded_cli_command commands[] = {
+        {"set", command_handler, NULL},
+        {"show", command_handler, NULL},
+        {"reset", command_handler, NULL},
+        {"status", command_handler, NULL},
+    };
+    struct {
+        const char *input;
+        const char *output;
+    } test_cases[] = {
+        {"v\t\n", "version "},
+        {"se\t\n", "set "},
+        {"  sh\tfoo\n", "  show foo"},
+        {"s\t\n", "s"},
+        {"st\t\n", "status "},
+        {"status\t\n", "status "},
+        {"res\t\t\n", "reset "},
+        {"foo \t\n", "foo "},
+        {"set st\t\n", "set st"},
+        {"x\t\n", "x"},
+        {"vn" LEFT "\t\n", "version n"},
+        {NULL, NULL},
+    };
+    struct embedded_cli cli;
+    char output[MAX_OUTPUT_LEN] = "\0";
+
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+        TEST_ASSERT(embedded_cli_register_command(&cli, &commands[i]));
+    for (int i = 0; test_cases[i].input; i++) {
+        test_insert_line(&cli, test_cases[i].input);
+        cli_equals(&cli, test_cases[i].output);
+    }
+
+    // Double tab lists the possibilities, with duplicates removed
+    embedded_cli_init(&cli, "> ", callback, output);
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+        TEST_ASSERT(embedded_cli_register_command(&cli, &commands[i]));
+    test_insert_line(&cli, "s\t");
+    TEST_ASSERT(strcmp(output, "s") == 0);
+    test_insert_line(&cli, "\t");
+    TEST_ASSERT_(strcmp(output, "s\r\nset  show  status  \r\n> s") == 0,
+                 "Got '%s'", output);
+
+    // Text inserted as a block also ends the completion, so the next tab
+    // completes again rather than listing
+    output[0] = '\0';
+    embedded_cli_init(&cli, "> ", callback, output);
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+        TEST_ASSERT(embedded_cli_register_command(&cli, &commands[i]));
+    test_insert_line(&cli, "\t");
+    embedded_cli_insert_buffer(&cli, "s", 1);
+    test_insert_line(&cli, "\t");
+    TEST_ASSERT_(strchr(output, '\n') == NULL, "Got '%s'", output);
+}
+#endif
+
+#if EMBEDDED_CLI_RX_BUF_LEN
+static void test_rx_buf(void)
+{
+    struct embedded_cli cli;
+    int count = 0;
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    TEST_ASSERT(!embedded_cli_poll(&cli));
+    while (embedded_cli_isr_push(&cli, 'a'))
+        count++;
+    TEST_ASSERT(count == EMBEDDED_CLI_RX_BUF_LEN - 1);
+    TEST_ASSERT(!embedded_cli_poll(&cli));
+    TEST_ASSERT(embedded_cli_isr_push(&cli, '\n'));
+    TEST_ASSERT(embedded_cli_isr_push(&cli, 'b'));
+    TEST_ASSERT(embedded_cli_isr_push(&cli, '\n'));
+    TEST_ASSERT(embedded_cli_poll(&cli));
+    TEST_ASSERT(strlen(embedded_cli_get_line(&cli)) == (size_t)count);
+    TEST_ASSERT(embedded_cli_poll(&cli));
+    cli_equals(&cli, "b");
+    TEST_ASSERT(!embedded_cli_poll(&cli));
+}
+
+#define RX_LINES 2000
+
+static struct embedded_cli rx_cli;
+
+static void *rx_thread(void *arg)
+{
+    char line[32];
+    (void)arg;
+    for (int i = 0; i < RX_LINES; i++) {
+        snprintf(line, sizeof(line), "line %d" LEFT RIGHT "\n", i);
+        for (const char *c = line; *c; c++)
+            while (!embedded_cli_isr_push(&rx_cli, *c))
+                sched_yield();
+    }
+    return NULL;
+}
+
+static void check_rx_lines(void)
+{
+    char line[32];
+    int received = 0;
+    while (received < RX_LINES) {
+        if (!embedded_cli_poll(&rx_cli))
+            continue;
+        snprintf(line, sizeof(line), "line %d", received);
+        cli_equals(&rx_cli, line);
+        received++;
+    }
+}
+
+static void test_rx_thread(void)
+{
+    pthread_t thread;
+    embedded_cli_init(&rx_cli, NULL, NULL, NULL);
+    TEST_ASSERT(pthread_create(&thread, NULL, rx_thread, NULL) == 0);
+    check_rx_lines();
+    pthread_join(thread, NULL);
+}
+
+static volatile sig_atomic_t rx_signal_pos;
+static char rx_signal_data[RX_LINES * 16];
+
+/**
+ * Stands in for a UART interrupt: drain as much pending input as the ring
+ * will take, from whatever point the main loop happens to be interrupted at
+ */
+static void rx_signal_handler(int sig)
+{
+    (void)sig;
+    while (rx_signal_data[rx_signal_pos] &&
+           embedded_cli_isr_push(&rx_cli, rx_signal_data[rx_signal_pos]))
+        rx_signal_pos++;
+}
+
+static void test_rx_signal(void)
+{
+    struct sigaction sa;
+    struct itimerval timer = {{0, 100}, {0, 100}};
+    struct itimerval stop = {{0, 0}, {0, 0}};
+    size_t len = 0;
+
+    for (int i = 0; i < RX_LINES; i++)
+        len += (size_t)snprintf(&rx_signal_data[len],
+                                sizeof(rx_signal_data) - len, "line %d\n", i);
+    rx_signal_pos = 0;
+    embedded_cli_init(&rx_cli, NULL, NULL, NULL);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = rx_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    TEST_ASSERT(sigaction(SIGALRM, &sa, NULL) == 0);
+    TEST_ASSERT(setitimer(ITIMER_REAL, &timer, NULL) == 0);
+    check_rx_lines();
+    setitimer(ITIMER_REAL, &stop, NULL);
+    signal(SIGALRM, SIG_DFL);
+}
+#endif
+
+#if EMBEDDED_CLI_TX_BUF_LEN
+static char tx_output[512];
+static size_t tx_output_len;
+
+/**
+ * Stands in for the DMA engine, sending everything which is queued
+ */
+static void tx_drain(void *data)
+{
+    struct embedded_cli *cli = data;
+    const char *buf;
+    size_t len;
+    while ((len = embedded_cli_tx_peek(cli, &buf)) > 0) {
+        TEST_ASSERT(tx_output_len + len < sizeof(tx_output));
+        memcpy(&tx_output[tx_output_len], buf, len);
+        tx_output_len += len;
+        tx_output[tx_output_len] = '\0';
+        embedded_cli_tx_ack(cli, len);
+    }
+}
+
+static void tx_reset(void)
+{
+    tx_output_len = 0;
+    tx_output[0] = '\0';
+}
+
+static void test_tx_buf(void)
+{
+    struct embedded_cli cli;
+    const char *buf;
+    const size_t prompt_len = strlen(PASTE_ON "> ");
+    char line[102];
+    char expected[128];
+
+    embedded_cli_init(&cli, "> ", NULL, NULL);
+    embedded_cli_set_tx_policy(&cli, EMBEDDED_CLI_TX_DROP, NULL);
+    TEST_ASSERT(embedded_cli_tx_peek(&cli, &buf) == 0);
+    embedded_cli_prompt(&cli);
+    TEST_ASSERT(embedded_cli_tx_peek(&cli, &buf) == prompt_len);
+    TEST_ASSERT(memcmp(buf, PASTE_ON "> ", prompt_len) == 0);
+    // Nothing is released until it has been acknowledged
+    TEST_ASSERT(embedded_cli_tx_peek(&cli, &buf) == prompt_len);
+    embedded_cli_tx_ack(&cli, 1);
+    TEST_ASSERT(embedded_cli_tx_peek(&cli, &buf) == prompt_len - 1);
+    embedded_cli_tx_ack(&cli, prompt_len - 1);
+
+    // Fill up the buffer without sending anything. None of the redraw
+    // should make it out, since it doesn't fit
+    tx_reset();
+    for (int i = 0; i < 100; i++)
+        embedded_cli_insert_char(&cli, 'a');
+    test_insert_line(&cli, CTRL_L);
+    tx_drain(&cli);
+    TEST_ASSERT(tx_output_len == 100);
+
+    // Once there's room, the whole line is redrawn
+    tx_reset();
+    embedded_cli_insert_char(&cli, 'b');
+    tx_drain(&cli);
+    memset(line, 'a', 100);
+    line[100] = 'b';
+    line[101] = '\0';
+    snprintf(expected, sizeof(expected), PASTE_ON MOVE_BOL CLEAR_EOL "> %s",
+             line);
+    TEST_ASSERT_(strcmp(tx_output, expected) == 0, "Got '%s'", tx_output);
+
+    // A line finished while output was being dropped is redrawn as a fresh
+    // prompt, once it has been handled
+    test_insert_line(&cli, CTRL_L CTRL_L "\n");
+    cli_equals(&cli, line);
+    tx_drain(&cli);
+    tx_reset();
+    embedded_cli_prompt(&cli);
+    embedded_cli_insert_char(&cli, 'x');
+    tx_drain(&cli);
+    TEST_ASSERT_(strcmp(tx_output, PASTE_ON MOVE_BOL CLEAR_EOL "> x") == 0,
+                 "Got '%s'", tx_output);
+
+    // Output which wraps around the end of the buffer comes out in two
+    // blocks
+    while (cli.tx_tail != EMBEDDED_CLI_TX_BUF_LEN - 1) {
+        embedded_cli_insert_char(&cli, cli.len < 100 ? 'y' : CTRL_C[0]);
+        tx_drain(&cli);
+    }
+    embedded_cli_insert_buffer(&cli, "yz", 2);
+    TEST_ASSERT(embedded_cli_tx_peek(&cli, &buf) == 1);
+    TEST_ASSERT(*buf == 'y');
+    embedded_cli_tx_ack(&cli, 1);
+    TEST_ASSERT(embedded_cli_tx_peek(&cli, &buf) == 1);
+    TEST_ASSERT(*buf == 'z');
+    embedded_cli_tx_ack(&cli, 1);
+    TEST_ASSERT(embedded_cli_tx_peek(&cli, &buf) == 0);
+}
+
+static void test_tx_block(void)
+{
+    const size_t prompt_len = strlen(PASTE_ON "> ");
+    struct embedded_cli cli;
+    char line[EMBEDDED_CLI_MAX_LINE];
+
+    embedded_cli_init(&cli, "> ", NULL, NULL);
+    embedded_cli_set_tx_policy(&cli, EMBEDDED_CLI_TX_BLOCK, tx_drain);
+    cli.cb_data = &cli;
+    tx_reset();
+    // Long enough to need several trips around the buffer
+    memset(line, 'a', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+    for (int i = 0; i < 3; i++) {
+        embedded_cli_prompt(&cli);
+        test_insert_line(&cli, line);
+        test_insert_line(&cli, CTRL_C);
+    }
+    tx_drain(&cli);
+    TEST_ASSERT(tx_output_len == 3 * (prompt_len + sizeof(line) - 1 + 6));
+    TEST_ASSERT(strncmp(&tx_output[prompt_len], line, sizeof(line) - 1) == 0);
+}
+#endif
+
+#if EMBEDDED_CLI_STATS
+static size_t stats_output;
+
+static void stats_putchar(void *data, char ch, bool is_last)
+{
+    (void)data;
+    (void)ch;
+    (void)is_last;
+    stats_output++;
+}
+
+static void test_stats(void)
+{
+    struct embedded_cli cli;
+    struct embedded_cli_stats stats;
+    char **argv;
+
+    embedded_cli_init(&cli, "> ", stats_putchar, NULL);
+    stats_output = 0;
+    // Backspace moves "bc\0", delete moves "c\0"
+    test_insert_line(&cli, "abc" LEFT LEFT "\b" DELETE "\n");
+    cli_equals(&cli, "c");
+    TEST_ASSERT(embedded_cli_argc(&cli, &argv) == 1);
+    embedded_cli_get_stats(&cli, &stats);
+    TEST_CHECK(stats.chars == 3 + 4 + 4 + 1 + 4 + 1);
+    TEST_CHECK(stats.escapes == 3);
+    TEST_CHECK(stats.lines == 1);
+    TEST_CHECK(stats.memmove_bytes == 3 + 2 + 1);
+    TEST_CHECK(stats.output_bytes == stats_output);
+    TEST_CHECK(stats.history_evictions == 0);
+    TEST_CHECK(stats.search_compares == 0);
+
+#if EMBEDDED_CLI_HISTORY_LEN
+    for (int i = 0; i < EMBEDDED_CLI_HISTORY_ENTRIES + 2; i++) {
+        char line[20];
+        snprintf(line, sizeof(line), "line %d\n", i);
+        test_insert_line(&cli, line);
+    }
+    embedded_cli_get_stats(&cli, &stats);
+    TEST_CHECK(stats.lines == EMBEDDED_CLI_HISTORY_ENTRIES + 3);
+    TEST_CHECK(stats.history_evictions == 3);
+
+    // The empty search term matches the most recent entry, then "z" is
+    // compared against all of them
+    test_insert_line(&cli, CTRL_R "zz" CTRL_C);
+    embedded_cli_get_stats(&cli, &stats);
+    TEST_CHECK(stats.search_compares == 1 + EMBEDDED_CLI_HISTORY_ENTRIES);
+#endif
+    TEST_CHECK(stats.output_bytes == stats_output);
+}
+#endif
+
+#if EMBEDDED_CLI_HISTORY_STORE
+/**
+ * Emulation of a small flash part. Erased bytes are 0xff, and each byte can
+ * only be written once, apart from a write at offset 0 which erases it
+ * first. With flash_erase false, it behaves like a file instead
+ */
+static uint8_t flash[256];
+static bool flash_written[sizeof(flash)];
+static bool flash_erase;
+static int flash_erases;
+
+static size_t flash_read(void *data, size_t offset, void *buf, size_t len)
+{
+    (void)data;
+    if (offset >= sizeof(flash))
+        return 0;
+    if (len > sizeof(flash) - offset)
+        len = sizeof(flash) - offset;
+    memcpy(buf, &flash[offset], len);
+    return len;
+}
+
+static bool flash_write(void *data, size_t offset, const void *buf,
+                        size_t len)
+{
+    const uint8_t *bytes = buf;
+    (void)data;
+    if (offset + len > sizeof(flash))
+        return false;
+    if (offset == 0) {
+        flash_erases++;
+        if (flash_erase)
+            memset(flash, 0xff, sizeof(flash));
+        memset(flash_written, 0, sizeof(flash_written));
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (flash_erase)
+            TEST_CHECK_(!flash_written[offset + i], "Overwrite at %zu",
+                        offset + i);
+        flash[offset + i] = bytes[i];
+        flash_written[offset + i] = true;
+    }
+    return true;
+}
+
+static const struct embedded_cli_history_store flash_store = {
+    flash_read, flash_write, NULL, sizeof(flash)};
+
+static void history_equals(struct embedded_cli *cli, const char **lines)
+{
+    int i;
+    for (i = 0; lines[i]; i++) {
+        const char *h = embedded_cli_get_history(cli, i);
+        TEST_ASSERT_(h && strcmp(h, lines[i]) == 0,
+                     "History %d: Expected '%s' got '%s'", i, lines[i],
+                     h ? h : "(null)");
+    }
+    TEST_CHECK(embedded_cli_get_history(cli, i) == NULL);
+}
+
+static void test_history_store(void)
+{
+    struct embedded_cli cli;
+
+    memset(flash, 0xff, sizeof(flash));
+    flash_erase = true;
+    flash_erases = 0;
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    TEST_CHECK(!embedded_cli_history_load(&cli, &flash_store));
+    test_insert_line(&cli, "first\n");
+    test_insert_line(&cli, "second\n");
+    test_insert_line(&cli, "third\n");
+    // New entries are only appended
+    TEST_CHECK(flash_erases == 1);
+
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    TEST_CHECK(embedded_cli_history_load(&cli, &flash_store));
+    history_equals(&cli, (const char *[]){"third", "second", "first", NULL});
+    test_insert_line(&cli, "fourth\n");
+    TEST_CHECK(flash_erases == 1);
+
+    // Damage "fourth", which should be dropped, and the store rewritten
+    flash[8 + 9 + 10 + 9 + 3] ^= 0x01;
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    TEST_CHECK(embedded_cli_history_load(&cli, &flash_store));
+    history_equals(&cli, (const char *[]){"third", "second", "first", NULL});
+    TEST_CHECK(flash_erases == 2);
+    test_insert_line(&cli, "fifth\n");
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    TEST_CHECK(embedded_cli_history_load(&cli, &flash_store));
+    history_equals(&cli, (const char *[]){"fifth", "third", "second",
+                                          "first", NULL});
+
+    // Once the store is full, it starts again with the most recent entries
+    for (int i = 0; i < 40; i++) {
+        char line[20];
+        snprintf(line, sizeof(line), "command %d\n", i);
+        test_insert_line(&cli, line);
+    }
+    TEST_CHECK(flash_erases > 2);
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    TEST_CHECK(embedded_cli_history_load(&cli, &flash_store));
+    TEST_CHECK(strcmp(embedded_cli_get_history(&cli, 0), "command 39") == 0);
+    TEST_CHECK(strcmp(embedded_cli_get_history(&cli, 9), "command 30") == 0);
+
+    // Without erasing, records from the previous history are left after
+    // the new ones. They mustn't be picked up
+    flash_erase = false;
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    test_insert_line(&cli, "only\n");
+    test_insert_line(&cli, "stale\n");
+    TEST_CHECK(embedded_cli_history_save(&cli, &flash_store));
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    test_insert_line(&cli, "only\n");
+    TEST_CHECK(embedded_cli_history_save(&cli, &flash_store));
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    TEST_CHECK(embedded_cli_history_load(&cli, &flash_store));
+    history_equals(&cli, (const char *[]){"only", NULL});
+
+    // Rubbish is ignored
+    memset(flash, 0x55, sizeof(flash));
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    TEST_CHECK(!embedded_cli_history_load(&cli, &flash_store));
+    history_equals(&cli, (const char *[]){NULL});
+}
+#endif
+
+#if EMBEDDED_CLI_RUNTIME_BUFFERS
+static void test_runtime_buffers(void)
+{
+    struct embedded_cli small, large;
+    char small_line[16], large_line[EMBEDDED_CLI_MAX_LINE];
+    char large_history[64];
+    char *small_argv[4], *large_argv[EMBEDDED_CLI_MAX_ARGC];
+    const struct embedded_cli_buffers small_buffers = {
+        small_line, sizeof(small_line), NULL, 0, small_argv, 4};
+    const struct embedded_cli_buffers large_buffers = {
+        large_line, sizeof(large_line),
+        large_history, sizeof(large_history),
+        large_argv, EMBEDDED_CLI_MAX_ARGC};
+    char **argv;
+
+    TEST_CHECK(
+        embedded_cli_init_buffers(&small, "> ", NULL, NULL, &small_buffers));
+    TEST_CHECK(
+        embedded_cli_init_buffers(&large, "> ", NULL, NULL, &large_buffers));
+
+    // Lines are limited to the size of the buffer
+    test_insert_line(&small, "a b c d e f g h i j k\n");
+    cli_equals(&small, "a b c d e f g h");
+    TEST_CHECK(embedded_cli_argc(&small, &argv) == 3);
+    TEST_CHECK(argv == small_argv);
+    TEST_CHECK(argv[3] == NULL);
+
+    test_insert_line(&large, "a b c d e f g h i j k\n");
+    cli_equals(&large, "a b c d e f g h i j k");
+    TEST_CHECK(embedded_cli_argc(&large, &argv) == 11);
+    TEST_CHECK(argv == large_argv);
+
+    // Without any history storage, there is no history
+    test_insert_line(&small, UP "\n");
+    cli_equals(&small, "");
+    TEST_CHECK(embedded_cli_get_history(&small, 0) == NULL);
+
+#if EMBEDDED_CLI_HISTORY_LEN
+    // Only the most recent entries fit in the small history buffer
+    for (int i = 0; i < 20; i++) {
+        char line[20];
+        snprintf(line, sizeof(line), "command %d\n", i);
+        test_insert_line(&large, line);
+    }
+    test_insert_line(&large, UP UP "\n");
+    cli_equals(&large, "command 18");
+    TEST_CHECK(embedded_cli_get_history(&large, 8) == NULL);
+#endif
+}
+
+static void test_runtime_buffers_minimum(void)
+{
+    struct embedded_cli cli, before;
+    char line[2];
+    char *argv_buf[1];
+    struct embedded_cli_buffers buffers = {line, sizeof(line), NULL, 0,
+                                           argv_buf, 1};
+    char **argv;
+
+    // Anything smaller is rejected, without touching the instance
+    memset(&cli, 0x5a, sizeof(cli));
+    before = cli;
+    for (size_t size = 0; size < 2; size++) {
+        buffers.line_size = size;
+        TEST_CHECK(!embedded_cli_init_buffers(&cli, "> ", NULL, NULL,
+                                              &buffers));
+    }
+    buffers.line_size = sizeof(line);
+    buffers.max_argc = 0;
+    TEST_CHECK(!embedded_cli_init_buffers(&cli, "> ", NULL, NULL, &buffers));
+    TEST_CHECK(memcmp(&cli, &before, sizeof(cli)) == 0);
+
+    // A single character line, with room for no arguments
+    buffers.max_argc = 1;
+    TEST_ASSERT(embedded_cli_init_buffers(&cli, "> ", NULL, NULL, &buffers));
+    test_insert_line(&cli, "ab\n");
+    cli_equals(&cli, "a");
+    TEST_CHECK(embedded_cli_argc(&cli, &argv) == 0);
+    TEST_CHECK(argv == argv_buf);
+    TEST_CHECK(argv[0] == NULL);
+}
+#endif
+
+#if !EMBEDDED_CLI_RUNTIME_BUFFERS
+static char static_output[MAX_OUTPUT_LEN];
+static struct embedded_cli static_cli;
+static struct embedded_cli initialised_cli =
+    EMBEDDED_CLI_STATIC_INIT("prompt> ", callback, static_output);
+
+static void test_static_init(void)
+{
+    struct embedded_cli cli;
+
+    // A zeroed instance is already what embedded_cli_init would produce,
+    // apart from the prompt & callback
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    TEST_ASSERT(memcmp(&cli, &static_cli, sizeof(cli)) == 0);
+    embedded_cli_init(&cli, "prompt> ", callback, static_output);
+    embedded_cli_set_put_char(&static_cli, callback, static_output);
+    embedded_cli_set_prompt(&static_cli, "prompt> ");
+    TEST_ASSERT(memcmp(&cli, &static_cli, sizeof(cli)) == 0);
+    TEST_ASSERT(memcmp(&cli, &initialised_cli, sizeof(cli)) == 0);
+
+    embedded_cli_prompt(&static_cli);
+    test_insert_line(&static_cli, "foo\n");
+    TEST_ASSERT(strcmp(static_output, PASTE_ON "prompt> foo\r\n") == 0);
+    cli_equals(&static_cli, "foo");
+#if EMBEDDED_CLI_HISTORY_LEN
+    test_insert_line(&static_cli, DOWN "bar\n");
+    cli_equals(&static_cli, "bar");
+    test_insert_line(&static_cli, UP UP "\n");
+    cli_equals(&static_cli, "foo");
+#endif
+}
+#endif
+
+/**
+ * The original argument parser, which shuffles the buffer down for every
+ * quote/escape. Used as a reference for the behaviour & performance of
+ * embedded_cli_argc
+ */
+static int reference_argc(char *buffer, size_t size, char **argv)
+{
+    int pos = 0;
+    bool in_arg = false;
+    bool in_escape = false;
+    char in_string = '\0';
+    for (size_t i = 0; i < size && buffer[i] != '\0';) {
+        if (in_escape) {
+            in_escape = false;
+            i++;
+            continue;
+        }
+        if (in_string) {
+            if (buffer[i] == in_string) {
+                memmove(&buffer[i], &buffer[i + 1], size - i - 1);
+                in_string = '\0';
+            } else {
+                i++;
+            }
+            continue;
+        }
+        if (buffer[i] == ' ' || buffer[i] == '\t' || buffer[i] == '\n' ||
+            buffer[i] == '\r') {
+            if (in_arg)
+                buffer[i] = '\0';
+            in_arg = false;
+            i++;
+            continue;
+        }
+        if (!in_arg) {
+            if (pos >= EMBEDDED_CLI_MAX_ARGC - 1)
+                break;
+            argv[pos++] = &buffer[i];
+            in_arg = true;
+        }
+        if (buffer[i] == '\\') {
+            memmove(&buffer[i], &buffer[i + 1], size - i - 1);
+            in_escape = true;
+        } else if (buffer[i] == '\'' || buffer[i] == '"') {
+            in_string = buffer[i];
+            memmove(&buffer[i], &buffer[i + 1], size - i - 1);
+        } else {
+            i++;
+        }
+    }
+    argv[pos] = NULL;
+    return pos;
+}
+
+static void check_argc_matches(const char *line)
+{
+    struct embedded_cli cli;
+    char buffer[EMBEDDED_CLI_MAX_LINE];
+    char *ref_argv[EMBEDDED_CLI_MAX_ARGC];
+    char **argv;
+    int ref_argc, argc;
+
+    embedded_cli_init(&cli, NULL, NULL, NULL);
+    embedded_cli_insert_buffer(&cli, line, strlen(line));
+    embedded_cli_insert_char(&cli, '\n');
+    memcpy(buffer, cli.buffer, sizeof(buffer));
+
+    ref_argc = reference_argc(buffer, sizeof(buffer), ref_argv);
+    argc = embedded_cli_argc(&cli, &argv);
+    TEST_ASSERT_(argc == ref_argc, "'%s': Expected %d args, got %d", line,
+                 ref_argc, argc);
+    for (int i = 0; i < argc; i++)
+        TEST_ASSERT_(strcmp(argv[i], ref_argv[i]) == 0,
+                     "'%s' arg %d: Expected '%s' got '%s'", line, i,
+                     ref_argv[i], argv[i]);
+    TEST_ASSERT(argv[argc] == NULL);
+}
+
+static void test_argc_worst_case(void)
+{
+    char line[EMBEDDED_CLI_MAX_LINE];
+    const char charset[] = "ab  '\"\\\t";
+    unsigned int seed = 1;
+    const char *patterns[] = {"\"", "'", "\\a", "''", "\\", "'\"", "a\""};
+
+    // Lines made up entirely of quotes & escapes are the worst case for
+    // the original parser
+    for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+        size_t len = 0;
+        while (len + strlen(patterns[p]) < sizeof(line)) {
+            memcpy(&line[len], patterns[p], strlen(patterns[p]));
+            len += strlen(patterns[p]);
+        }
+        line[len] = '\0';
+        check_argc_matches(line);
+    }
+
+    // Random mix of plain text, whitespace, quotes & escapes
+    for (int i = 0; i < 2000; i++) {
+        size_t len = (size_t)i % sizeof(line);
+        for (size_t j = 0; j < len; j++) {
+            seed = seed * 1103515245 + 12345;
+            line[j] = charset[(seed >> 16) % (sizeof(charset) - 1)];
+        }
+        line[len] = '\0';
+        check_argc_matches(line);
+    }
+}
+
 static void test_too_many_args(void)
 {
     struct embedded_cli cli;
@@ -293,14 +1715,14 @@ static void test_max_chars(void)
     }
     // Make sure we cannot insert a character now
     embedded_cli_insert_char(&cli, 'x');
-    TEST_ASSERT(cli.buffer[sizeof(cli.buffer) - 2] == 'b');
-    TEST_ASSERT(cli.buffer[sizeof(cli.buffer) - 1] == '\0');
+    TEST_ASSERT(cli.buffer[EMBEDDED_CLI_MAX_LINE - 2] == 'b');
+    TEST_ASSERT(cli.buffer[EMBEDDED_CLI_MAX_LINE - 1] == '\0');
     // Make sure we can backspace & change the last character
     embedded_cli_insert_char(&cli, '\b');
     embedded_cli_insert_char(&cli, 'f');
     // There is always a nul at the end, so the one before that should now be
     // an f
-    TEST_ASSERT(cli.buffer[sizeof(cli.buffer) - 2] == 'f');
+    TEST_ASSERT(cli.buffer[EMBEDDED_CLI_MAX_LINE - 2] == 'f');
 }
 
 static void test_utf8(void)
@@ -323,15 +1745,75 @@ TEST_LIST = {{"simple", test_simple},
              {"delete", test_delete},
              {"cursor_left", test_cursor_left},
              {"cursor_right", test_cursor_right},
+             {"escape_keys", test_escape_keys},
 #if EMBEDDED_CLI_HISTORY_LEN
              {"history", test_history},
+             {"history_wrap", test_history_wrap},
+#if EMBEDDED_CLI_HISTORY_COMPRESS
+             {"history_compress", test_history_compress},
+#if EMBEDDED_CLI_HISTORY_LEN < EMBEDDED_CLI_MAX_LINE
+             {"history_too_long", test_history_too_long},
+#endif
+#endif
+#if EMBEDDED_CLI_HISTORY_DEDUP
+             {"history_dedup", test_history_dedup},
+#endif
              {"history_keys", test_history_keys},
              {"search", test_search},
+             {"search_repeat", test_search_repeat},
              {"up_down", test_up_down},
 #endif
              {"multiple", test_multiple},
              {"echo", test_echo},
+             {"redraw", test_redraw},
+             {"deferred_redraw", test_deferred_redraw},
+#if EMBEDDED_CLI_BRACKETED_PASTE
+             {"bracketed_paste", test_bracketed_paste},
+#endif
+#if EMBEDDED_CLI_BATCH_MODE && EMBEDDED_CLI_MAX_COMMANDS
+             {"batch", test_batch},
+#endif
+#if EMBEDDED_CLI_HISTORY_LEN
+             {"redraw_random", test_redraw_random},
+#endif
+             {"insert_buffer", test_insert_buffer},
+#if EMBEDDED_CLI_OUTPUT_BUF_LEN
+             {"put_buf", test_put_buf},
+#endif
              {"quotes", test_quotes},
+             {"args", test_args},
+#if EMBEDDED_CLI_MAX_COMMANDS
+             {"commands", test_commands},
+#endif
+#if EMBEDDED_CLI_LINKER_COMMANDS
+             {"linker_commands", test_linker_commands},
+#endif
+#if EMBEDDED_CLI_MAX_COMMANDS && EMBEDDED_CLI_LINKER_COMMANDS
+             {"completion", test_completion},
+#endif
+#if EMBEDDED_CLI_RX_BUF_LEN
+             {"rx_buf", test_rx_buf},
+             {"rx_thread", test_rx_thread},
+             {"rx_signal", test_rx_signal},
+#endif
+#if EMBEDDED_CLI_TX_BUF_LEN
+             {"tx_buf", test_tx_buf},
+             {"tx_block", test_tx_block},
+#endif
+#if EMBEDDED_CLI_STATS
+             {"stats", test_stats},
+#endif
+#if EMBEDDED_CLI_HISTORY_STORE
+             {"history_store", test_history_store},
+#endif
+#if EMBEDDED_CLI_RUNTIME_BUFFERS
+             {"runtime_buffers", test_runtime_buffers},
+             {"runtime_buffers_minimum", test_runtime_buffers_minimum},
+#endif
+#if !EMBEDDED_CLI_RUNTIME_BUFFERS
+             {"static_init", test_static_init},
+#endif
+             {"argc_worst_case", test_argc_worst_case},
              {"too_many_args", test_too_many_args},
              {"max_chars", test_max_chars},
              {"utf8", test_utf8},
@@ -34,30 +34,35 @@ fi
 echo "Binary sizes (ARM Thumb-2, -Os):"
 $SIZE embedded_cli.o
 
-# Calculate size of the structure
+# Calculate size of the structure, with and without the compact layout
 cat <<EOF > struct_size.c
 #include "embedded_cli.h"
 struct embedded_cli cli;
 EOF
 
-$CC $CFLAGS -Imock_incl -c struct_size.c -o struct_size.o
-if [ $? -ne 0 ]; then
-    echo "Error: Compilation of struct_size.c failed"
-    rm -rf mock_incl embedded_cli.o struct_size.c
-    exit 1
-fi
+struct_size() {
+    $CC $CFLAGS -Imock_incl "$@" -c struct_size.c -o struct_size.o
+    if [ $? -ne 0 ]; then
+        echo "Error: Compilation of struct_size.c failed" >&2
+        return 1
+    fi
 
-# Get size using nm
-STRUCT_SIZE_HEX=$($NM -S struct_size.o | grep " cli" | awk '{print $2}')
+    # Get size using nm
+    STRUCT_SIZE_HEX=$($NM -S struct_size.o | grep " cli" | awk '{print $2}')
+    if [ -z "$STRUCT_SIZE_HEX" ]; then
+        echo "Error: Could not find 'cli' symbol in object file" >&2
+        return 1
+    fi
 
-if [ -z "$STRUCT_SIZE_HEX" ]; then
-    echo "Error: Could not find 'cli' symbol in object file"
-else
     # Convert hex size from nm to decimal
-    STRUCT_SIZE_DECIMAL=$((16#$STRUCT_SIZE_HEX))
-    echo ""
-    echo "Size of struct embedded_cli: $STRUCT_SIZE_DECIMAL bytes"
-fi
+    echo $((16#$STRUCT_SIZE_HEX))
+}
+
+echo ""
+STRUCT_SIZE=$(struct_size) || STRUCT_SIZE="?"
+echo "Size of struct embedded_cli: $STRUCT_SIZE bytes"
+STRUCT_SIZE=$(struct_size -DEMBEDDED_CLI_COMPACT=1) || STRUCT_SIZE="?"
+echo "Size of struct embedded_cli (EMBEDDED_CLI_COMPACT): $STRUCT_SIZE bytes"
 
 # Cleanup
 rm -rf embedded_cli.o struct_size.c struct_size.o mock_incl